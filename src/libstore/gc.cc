@@ -1,7 +1,10 @@
+#include "config.h"
+
 #include "globals.hh"
 #include "misc.hh"
 #include "pathlocks.hh"
 #include "local-store.hh"
+#include "worker-pool.hh"
 
 #include <boost/shared_ptr.hpp>
 
@@ -11,9 +14,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <unistd.h>
+#include <signal.h>
+#include <string.h>
 
 
 namespace nix {
@@ -21,6 +30,7 @@ namespace nix {
 
 static string gcLockName = "gc.lock";
 static string tempRootsDir = "temproots";
+static string tempRootsRegistryName = "temproots.shm";
 static string gcRootsDir = "gcroots";
 
 static const int defaultGcLevel = 1000;
@@ -31,7 +41,7 @@ static const int defaultGcLevel = 1000;
    read.  To be precise: when they try to create a new temporary root
    file, they will block until the garbage collector has finished /
    yielded the GC lock. */
-static int openGCLock(LockType lockType)
+int LocalStore::openGCLock(LockType lockType)
 {
     Path fnGCLock = (format("%1%/%2%")
         % nixStateDir % gcLockName).str();
@@ -146,13 +156,255 @@ Path addPermRoot(const Path & _storePath, const Path & _gcRoot,
 }
 
 
-/* The file to which we write our temporary roots. */
+/* The shared temporary roots registry.  This is a file mapped into
+   the memory of every Nix process, consisting of a header followed
+   by a table of slots, each holding one temporary root.  A process
+   claims a free slot by atomically setting its owner to its own pid,
+   so adding a root requires no locks or system calls.  The slots of
+   a process are freed when it exits; the collector frees the slots
+   of processes that have died.
+
+   To prevent a root from being added while the collector is
+   deleting paths, the collector sets `gcActive' before reading the
+   registry, and clears it when it releases the GC lock.  A process
+   that sees `gcActive' after publishing a root may have been missed,
+   so it waits for the GC lock.  Since both sides issue a memory
+   barrier between their write and their read, either the collector
+   sees the root or the process sees the flag.
+
+   Roots that don't fit in a slot, or that cannot be added because
+   the registry is full or unavailable, are written to a
+   per-process file in the `temproots' directory instead. */
+static const unsigned int tempRootsMagic = 0x6e746d70;
+
+struct TempRootsHeader
+{
+    unsigned int magic;
+    volatile unsigned int gcActive;
+    volatile unsigned int next; /* where to look for a free slot */
+    char padding[52];
+};
+
+struct TempRootSlot
+{
+    /* The process that owns this slot, or 0 if it is free. */
+    volatile pid_t owner;
+    /* Odd while the owner writes `path', so that readers can detect a
+       slot being reused under them.  Only the owner changes it, except
+       that the collector makes it even again if the owner died while
+       it was odd. */
+    volatile unsigned int seq;
+    char path[504];
+};
+
+static TempRootsHeader * registry = 0;
+static TempRootSlot * registrySlots = 0;
+static unsigned int registrySize = 0;
+static bool registryOpened = false;
+static bool registryEnabled = false;
+
+/* The roots this process has added to the registry. */
+static pid_t registryPid = 0;
+static PathSet registryRoots;
+static vector<unsigned int> registryOwnedSlots;
+
+/* Whether this process is the collector. */
+static bool collecting = false;
+
+
+static bool openTempRootsRegistry()
+{
+    if (registryOpened) return registry != 0;
+    registryOpened = true;
+
+    /* If the number of slots is 0, we don't add roots to the
+       registry, but the collector still reads it. */
+    unsigned int nrSlots = queryIntSetting("gc-temp-roots-slots", 16384);
+    registryEnabled = nrSlots != 0;
+
+    Path fn = (format("%1%/%2%") % nixStateDir % tempRootsRegistryName).str();
+    AutoCloseFD fd = open(fn.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        printMsg(lvlError, format("warning: cannot open `%1%': %2%") % fn % strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("statting `%1%'") % fn);
+
+    /* Grow the registry if it has fewer slots than configured, but
+       never shrink it, since other processes may be using it. */
+    off_t size = sizeof(TempRootsHeader) + (off_t) nrSlots * sizeof(TempRootSlot);
+    if (st.st_size < size) {
+        if (ftruncate(fd, size) == -1) {
+            printMsg(lvlError, format("warning: cannot resize `%1%': %2%") % fn % strerror(errno));
+            return false;
+        }
+    } else size = st.st_size;
+
+    void * p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        printMsg(lvlError, format("warning: cannot map `%1%': %2%") % fn % strerror(errno));
+        return false;
+    }
+
+    TempRootsHeader * header = (TempRootsHeader *) p;
+    __sync_bool_compare_and_swap(&header->magic, 0, tempRootsMagic);
+    if (header->magic != tempRootsMagic) {
+        printMsg(lvlError, format("warning: `%1%' is corrupt") % fn);
+        munmap(p, size);
+        return false;
+    }
+
+    registry = header;
+    registrySlots = (TempRootSlot *) (header + 1);
+    registrySize = (size - sizeof(TempRootsHeader)) / sizeof(TempRootSlot);
+    return true;
+}
+
+
+/* Add `path' to the shared registry.  Returns false if the caller
+   should fall back to the per-process file.  Sets `mustWait' if the
+   collector may have missed the root. */
+static bool addSharedTempRoot(const Path & path, bool & mustWait)
+{
+    mustWait = false;
+
+    if (path.size() >= sizeof(registrySlots->path)) return false;
+    if (!openTempRootsRegistry() || !registryEnabled) return false;
+
+    /* Slots owned by our parent aren't ours. */
+    pid_t pid = getpid();
+    if (registryPid != pid) {
+        registryPid = pid;
+        registryRoots.clear();
+        registryOwnedSlots.clear();
+    }
+
+    if (registryRoots.find(path) != registryRoots.end()) return true;
+
+    for (unsigned int n = 0; n < registrySize; ++n) {
+        unsigned int i = __sync_fetch_and_add(&registry->next, 1) % registrySize;
+        TempRootSlot & slot(registrySlots[i]);
+
+        /* Claim the slot first, so that whatever state we leave it in
+           if we die, the collector sees our pid and can free it.  Until
+           `seq' is odd, a reader may take the previous path for one of
+           our roots, which is harmless. */
+        if (slot.owner != 0 ||
+            !__sync_bool_compare_and_swap(&slot.owner, 0, pid))
+            continue;
+
+        /* A free slot can still be odd if an older version of this
+           code died while claiming it. */
+        if (slot.seq % 2 == 0) __sync_fetch_and_add(&slot.seq, 1);
+        strcpy(slot.path, path.c_str());
+        __sync_fetch_and_add(&slot.seq, 1);
+
+        registryRoots.insert(path);
+        registryOwnedSlots.push_back(i);
+
+        __sync_synchronize();
+        mustWait = registry->gcActive && !collecting;
+
+        return true;
+    }
+
+    return false;
+}
+
+
+/* Read the roots in the shared registry, and free the slots of
+   processes that have died. */
+static void readSharedTempRoots(PathSet & tempRoots)
+{
+    if (!openTempRootsRegistry()) return;
+
+    registry->gcActive = 1;
+    __sync_synchronize();
+
+    for (unsigned int i = 0; i < registrySize; ++i) {
+        TempRootSlot & slot(registrySlots[i]);
+
+        pid_t owner = slot.owner;
+        if (owner == 0) continue;
+
+        /* Skip slots that are being written.  Their owner will see
+           `gcActive' and wait for us.  But free slots left odd by a
+           process that died while writing them. */
+        unsigned int seq = slot.seq;
+        if (seq % 2) {
+            if (kill(owner, 0) == -1 && errno == ESRCH &&
+                __sync_bool_compare_and_swap(&slot.seq, seq, seq + 1))
+            {
+                debug(format("freeing slot of dead process %1%") % owner);
+                __sync_bool_compare_and_swap(&slot.owner, owner, 0);
+            }
+            continue;
+        }
+        __sync_synchronize();
+        char buf[sizeof(slot.path)];
+        memcpy(buf, slot.path, sizeof(buf));
+        buf[sizeof(buf) - 1] = 0;
+        __sync_synchronize();
+        if (slot.seq != seq || slot.owner != owner) continue;
+
+        if (kill(owner, 0) == -1 && errno == ESRCH) {
+            debug(format("freeing temporary root `%1%' of dead process %2%") % buf % owner);
+            __sync_bool_compare_and_swap(&slot.owner, owner, 0);
+            continue;
+        }
+
+        /* A slot that was claimed just now may still hold the
+           previous path, or none; as above, its owner will wait for
+           us. */
+        Path root(buf);
+        if (!isStorePath(root)) {
+            debug(format("ignoring invalid temporary root `%1%' of process %2%") % root % owner);
+            continue;
+        }
+        debug(format("got temporary root `%1%'") % root);
+        tempRoots.insert(root);
+    }
+}
+
+
+/* Allow processes to add temporary roots to the shared registry
+   without waiting for the GC lock. */
+static void clearGCActive()
+{
+    if (!registry) return;
+    __sync_synchronize();
+    registry->gcActive = 0;
+}
+
+
+struct GCActiveGuard
+{
+    GCActiveGuard() { collecting = true; }
+    ~GCActiveGuard() { clearGCActive(); collecting = false; }
+};
+
+
+/* The file to which we write our temporary roots if they cannot be
+   added to the registry. */
 static Path fnTempRoots;
 static AutoCloseFD fdTempRoots;
 
 
 void LocalStore::addTempRoot(const Path & path)
 {
+    bool mustWait;
+    if (addSharedTempRoot(path, mustWait)) {
+        if (mustWait) {
+            debug(format("waiting for the collector to finish before using `%1%'") % path);
+            AutoCloseFD fdGCLock = openGCLock(ltRead);
+        }
+        markUsed(path);
+        return;
+    }
+
     /* Create the temporary roots file for this process. */
     if (fdTempRoots == -1) {
 
@@ -202,11 +454,20 @@ void LocalStore::addTempRoot(const Path & path)
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on `%1%'") % fnTempRoots);
     lockFile(fdTempRoots, ltRead, true);
+
+    markUsed(path);
 }
 
 
 void removeTempRoots()
 {
+    if (registry && registryPid == getpid()) {
+        foreach (vector<unsigned int>::iterator, i, registryOwnedSlots)
+            __sync_bool_compare_and_swap(&registrySlots[*i].owner, registryPid, 0);
+        registryOwnedSlots.clear();
+        registryRoots.clear();
+    }
+
     if (fdTempRoots != -1) {
         fdTempRoots.close();
         unlink(fnTempRoots.c_str());
@@ -220,6 +481,8 @@ typedef list<FDPtr> FDs;
 
 static void readTempRoots(PathSet & tempRoots, FDs & fds)
 {
+    readSharedTempRoots(tempRoots);
+
     /* Read the `temproots' directory for per-process temporary root
        files. */
     Strings tempRootFiles = readDirectory(
@@ -276,99 +539,507 @@ static void readTempRoots(PathSet & tempRoots, FDs & fds)
 }
 
 
-static void findRoots(const Path & path, bool recurseSymlinks,
-    bool deleteStale, Roots & roots)
+/* Root discovery.  The `gcroots' tree, the directories that symlinks
+   in it point to, and the processes that are running are scanned
+   concurrently by a pool of `gc-roots-jobs' worker processes.  The
+   workers only read the file system; the collector resolves the
+   symlinks they report and checks the validity of their targets.
+
+   Requests are `<id> scan <cache-key> <path>' and `<id> runtime'.
+   Replies are sequences of null-terminated fields.  If `path' is a
+   directory, the reply is `d' and its cache key (inode number and
+   modification time), followed by `d <name>' for each subdirectory
+   and `l <name> <target>' for each symlink.  But if the cache key
+   given in the request matches, the directory hasn't changed since
+   the last scan, and the reply is just `c'.  If `path' is a symlink,
+   the reply is `l <target>'; for other files it is `o', and if `path'
+   cannot be read it is `e <errno> <message>'.  The reply to `runtime'
+   is `r' followed by the store paths in use by running processes.
+
+   Requests and replies are lines, so names containing newlines cannot
+   be passed through the pool.  The collector scans such paths itself,
+   and a worker that comes across such a name replies `w', so that the
+   collector repeats the request itself. */
+static string gcRootsCacheName = "gcroots.cache";
+
+
+static void addField(string & reply, const string & field)
+{
+    reply += field;
+    reply += '\0';
+}
+
+
+static Strings splitFields(const string & reply)
+{
+    Strings fields;
+    string::size_type pos = 0, end;
+    while ((end = reply.find((char) 0, pos)) != string::npos) {
+        fields.push_back(string(reply, pos, end - pos));
+        pos = end + 1;
+    }
+    return fields;
+}
+
+
+static string dirCacheKey(const struct stat & st)
+{
+#if HAVE_STRUCT_STAT_ST_MTIM
+    unsigned long mtimeNs = st.st_mtim.tv_nsec;
+#else
+    unsigned long mtimeNs = 0;
+#endif
+    return (format("%1%:%2%:%3%") % st.st_ino % st.st_mtime % mtimeNs).str();
+}
+
+
+static bool hasNewline(const string & s)
+{
+    return s.find('\n') != string::npos;
+}
+
+
+static string scanRootPath(const Path & path, const string & cacheKey,
+    bool inWorker)
 {
+    string reply;
+
     try {
-        
         struct stat st;
         if (lstat(path.c_str(), &st) == -1)
             throw SysError(format("statting `%1%'") % path);
 
-        printMsg(lvlVomit, format("looking at `%1%'") % path);
-
         if (S_ISDIR(st.st_mode)) {
+            string key = dirCacheKey(st);
+            if (key == cacheKey) return "c" + string(1, 0);
+
+            addField(reply, "d");
+            addField(reply, key);
+
             Strings names = readDirectory(path);
-            foreach (Strings::iterator, i, names)
-                findRoots(path + "/" + *i, recurseSymlinks, deleteStale, roots);
+            foreach (Strings::iterator, i, names) {
+                if (inWorker && hasNewline(*i)) return "w" + string(1, 0);
+                Path child = path + "/" + *i;
+                if (lstat(child.c_str(), &st) == -1) continue;
+                if (S_ISDIR(st.st_mode)) {
+                    addField(reply, "d");
+                    addField(reply, *i);
+                } else if (S_ISLNK(st.st_mode)) {
+                    string target = readLink(child);
+                    if (inWorker && hasNewline(target)) return "w" + string(1, 0);
+                    addField(reply, "l");
+                    addField(reply, *i);
+                    addField(reply, target);
+                }
+            }
         }
 
         else if (S_ISLNK(st.st_mode)) {
-            Path target = absPath(readLink(path), dirOf(path));
-
-            if (isInStore(target)) {
-                debug(format("found root `%1%' in `%2%'")
-                    % target % path);
-                Path storePath = toStorePath(target);
-                if (store->isValidPath(storePath)) 
-                    roots[path] = storePath;
-                else
-                    printMsg(lvlInfo, format("skipping invalid root from `%1%' to `%2%'")
-                        % path % storePath);
+            string target = readLink(path);
+            if (inWorker && hasNewline(target)) return "w" + string(1, 0);
+            addField(reply, "l");
+            addField(reply, target);
+        }
+
+        else addField(reply, "o");
+    }
+
+    catch (SysError & e) {
+        reply.clear();
+        addField(reply, "e");
+        addField(reply, int2String(e.errNo));
+        addField(reply, e.msg());
+    }
+
+    return reply;
+}
+
+
+static void addRuntimeRoot(const string & path, PathSet & roots)
+{
+    if (isInStore(path)) roots.insert(toStorePath(path));
+}
+
+
+static void readProcLink(const Path & path, PathSet & roots)
+{
+    char buf[PATH_MAX];
+    ssize_t res = readlink(path.c_str(), buf, sizeof(buf));
+    if (res > 0) addRuntimeRoot(string(buf, res), roots);
+}
+
+
+static void readRootsFile(const Path & path, PathSet & roots)
+{
+    try {
+        Strings lines = tokenizeString(readFile(path), "\n");
+        foreach (Strings::iterator, i, lines) addRuntimeRoot(*i, roots);
+    } catch (SysError & e) {
+    }
+}
+
+
+/* Find the store paths that running processes are executing, have
+   open, or have mapped into memory, by scanning /proc.  On systems
+   without /proc, fall back to lsof.  If NIX_ROOT_FINDER is set, run
+   that program instead; it should print the paths, one per line. */
+static void findRuntimeRoots(PathSet & roots)
+{
+    const char * rootFinder = getenv("NIX_ROOT_FINDER");
+    if (rootFinder) {
+        if (*rootFinder) {
+            Strings paths = tokenizeString(runProgram(rootFinder), "\n");
+            foreach (Strings::iterator, i, paths) addRuntimeRoot(*i, roots);
+        }
+        return;
+    }
+
+    AutoCloseDir procDir = opendir("/proc");
+
+    if (procDir) {
+        struct dirent * dirent;
+        while ((dirent = readdir(procDir))) {
+            checkInterrupt();
+            string name = dirent->d_name;
+            if (name.find_first_not_of("0123456789") != string::npos) continue;
+            Path process = "/proc/" + name;
+
+            readProcLink(process + "/exe", roots);
+            readProcLink(process + "/cwd", roots);
+
+            AutoCloseDir fdDir = opendir((process + "/fd").c_str());
+            if (fdDir) {
+                struct dirent * fdEnt;
+                while ((fdEnt = readdir(fdDir)))
+                    if (fdEnt->d_name[0] != '.')
+                        readProcLink(process + "/fd/" + fdEnt->d_name, roots);
             }
 
-            else if (recurseSymlinks) {
-                if (pathExists(target))
-                    findRoots(target, false, deleteStale, roots);
-                else if (deleteStale) {
-                    printMsg(lvlInfo, format("removing stale link from `%1%' to `%2%'") % path % target);
-                    /* Note that we only delete when recursing, i.e.,
-                       when we are still in the `gcroots' tree.  We
-                       never delete stuff outside that tree. */
-                    unlink(path.c_str());
+            /* Lines in `maps' look like `<addresses> <perms> <offset>
+               <dev> <inode> <path>'. */
+            try {
+                Strings lines = tokenizeString(readFile(process + "/maps"), "\n");
+                foreach (Strings::iterator, i, lines) {
+                    Strings fields = tokenizeString(*i, " \t");
+                    if (fields.size() == 6) addRuntimeRoot(fields.back(), roots);
                 }
+            } catch (SysError & e) {
             }
         }
+    }
 
+    else {
+        try {
+            Strings args;
+            args.push_back("-n");
+            args.push_back("-w");
+            args.push_back("-F");
+            args.push_back("n");
+            Strings lines = tokenizeString(runProgram("lsof", true, args), "\n");
+            foreach (Strings::iterator, i, lines)
+                if (i->size() > 1 && (*i)[0] == 'n') addRuntimeRoot(string(*i, 1), roots);
+        } catch (Error & e) {
+        }
     }
 
-    catch (SysError & e) {
-        /* We only ignore permanent failures. */
-        if (e.errNo == EACCES || e.errNo == ENOENT || e.errNo == ENOTDIR)
-            printMsg(lvlInfo, format("cannot read potential root `%1%'") % path);
-        else
-            throw;
+    /* This is rather NixOS-specific, so it probably shouldn't be
+       here. */
+    readRootsFile("/proc/sys/kernel/modprobe", roots);
+    readRootsFile("/proc/sys/kernel/fbsplash", roots);
+}
+
+
+struct RootScanHandler : WorkerHandler
+{
+    bool inWorker;
+
+    RootScanHandler(bool inWorker) : inWorker(inWorker) { }
+
+    string operator () (const string & request)
+    {
+        string::size_type sp1 = request.find(' ');
+        string::size_type sp2 = request.find(' ', sp1 + 1);
+        string kind(request, sp1 + 1, sp2 == string::npos ? string::npos : sp2 - sp1 - 1);
+
+        if (kind == "runtime") {
+            string reply;
+            addField(reply, "r");
+            try {
+                PathSet roots;
+                findRuntimeRoots(roots);
+                foreach (PathSet::iterator, i, roots) {
+                    if (inWorker && hasNewline(*i)) return "w" + string(1, 0);
+                    addField(reply, *i);
+                }
+            } catch (Error & e) {
+                reply.clear();
+                addField(reply, "e");
+                addField(reply, "0");
+                addField(reply, e.msg());
+            }
+            return reply;
+        }
+
+        string::size_type sp3 = request.find(' ', sp2 + 1);
+        return scanRootPath(string(request, sp3 + 1),
+            string(request, sp2 + 1, sp3 - sp2 - 1), inWorker);
+    }
+};
+
+
+/* The directory listings from the last scan, if `gc-cache-roots' is
+   set, indexed by path. */
+typedef std::map<Path, string> RootsCache;
+static RootsCache rootsCache;
+static bool rootsCacheLoaded = false;
+
+
+static void loadRootsCache()
+{
+    if (rootsCacheLoaded) return;
+    rootsCacheLoaded = true;
+
+    Path path = (format("%1%/%2%") % nixStateDir % gcRootsCacheName).str();
+    if (!pathExists(path)) return;
+
+    try {
+        string contents = readFile(path);
+        StringSource source(contents);
+        if (readInt(source) != 1) return;
+        unsigned int count = readInt(source);
+        while (count--) {
+            Path dir = readString(source);
+            rootsCache[dir] = readString(source);
+        }
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: ignoring corrupt roots cache `%1%'") % path);
+        rootsCache.clear();
     }
 }
 
 
-static Roots findRoots(bool deleteStale)
+static void saveRootsCache()
 {
-    Roots roots;
-    Path rootsDir = canonPath((format("%1%/%2%") % nixStateDir % gcRootsDir).str());
-    findRoots(rootsDir, true, deleteStale, roots);
-    return roots;
+    StringSink sink;
+    writeInt(1, sink);
+    writeInt(rootsCache.size(), sink);
+    foreach (RootsCache::iterator, i, rootsCache) {
+        writeString(i->first, sink);
+        writeString(i->second, sink);
+    }
+
+    Path path = (format("%1%/%2%") % nixStateDir % gcRootsCacheName).str();
+    Path tmp = (format("%1%.tmp-%2%") % path % getpid()).str();
+    writeFile(tmp, sink.s);
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError(format("renaming `%1%' to `%2%'") % tmp % path);
 }
 
 
-Roots LocalStore::findRoots()
+/* Whether a directory listing can be cached.  Directories modified
+   in the last two seconds are not, since a change in the same
+   second might not change the modification time. */
+static bool isCacheable(const string & key, time_t now)
 {
-    return nix::findRoots(false);
+    Strings parts = tokenizeString(key, ":");
+    if (parts.size() != 3) return false;
+    long long mtime;
+    return string2Int(*++parts.begin(), mtime) && mtime < now - 1;
 }
 
 
-static void addAdditionalRoots(PathSet & roots)
+struct RootScanItem
 {
-    Path rootFinder = getEnv("NIX_ROOT_FINDER",
-        nixLibexecDir + "/nix/find-runtime-roots.pl");
+    Path path;
+    bool recurseSymlinks;
+    Path link; /* the symlink in `gcroots' that points to `path' */
+    RootScanItem() { }
+    RootScanItem(const Path & path, bool recurseSymlinks, const Path & link)
+        : path(path), recurseSymlinks(recurseSymlinks), link(link) { }
+};
 
-    if (rootFinder.empty()) return;
-    
-    debug(format("executing `%1%' to find additional roots") % rootFinder);
+typedef std::list<RootScanItem> RootScanItems;
 
-    string result = runProgram(rootFinder);
 
-    Strings paths = tokenizeString(result, "\n");
-    
-    foreach (Strings::iterator, i, paths) {
-        if (isInStore(*i)) {
-            Path path = toStorePath(*i);
-            if (roots.find(path) == roots.end() && store->isValidPath(path)) {
-                debug(format("got additional root `%1%'") % path);
-                roots.insert(path);
+static void foundRootLink(const Path & path, const string & target_,
+    bool recurseSymlinks, Roots & roots, RootScanItems & todo)
+{
+    Path target = absPath(target_, dirOf(path));
+
+    if (isInStore(target)) {
+        debug(format("found root `%1%' in `%2%'")
+            % target % path);
+        Path storePath = toStorePath(target);
+        if (store->isValidPath(storePath)) 
+            roots[path] = storePath;
+        else
+            printMsg(lvlInfo, format("skipping invalid root from `%1%' to `%2%'")
+                % path % storePath);
+    }
+
+    /* Symlinks outside the store are followed one level. */
+    else if (recurseSymlinks)
+        todo.push_back(RootScanItem(target, false, path));
+}
+
+
+/* Find the roots in the `gcroots' tree, and if `runtime' is set, the
+   runtime roots. */
+static void scanRoots(bool deleteStale, bool runtime,
+    Roots & roots, PathSet & runtimeRoots)
+{
+    bool useCache = queryBoolSetting("gc-cache-roots", false);
+    if (useCache) loadRootsCache();
+    RootsCache newCache;
+    time_t now = time(0);
+
+    unsigned int jobs = queryIntSetting("gc-roots-jobs", 1);
+    RootScanHandler handler(jobs > 1), localHandler(false);
+    WorkerPool pool(handler, jobs > 1 ? jobs : 0);
+
+    /* Requests that were handled in this process, with their
+       replies. */
+    std::list<std::pair<string, string> > localReplies;
+
+    Path rootsDir = canonPath((format("%1%/%2%") % nixStateDir % gcRootsDir).str());
+    RootScanItems todo;
+    todo.push_back(RootScanItem(rootsDir, true, ""));
+
+    std::map<unsigned int, RootScanItem> running;
+    unsigned int nextId = 0;
+    bool runtimeTodo = runtime;
+    double startTime = getTime(), scanTime = 0;
+    unsigned int nrDirs = 0, nrCached = 0;
+
+    while (runtimeTodo || !todo.empty() || pool.busy() || !localReplies.empty()) {
+
+        /* Start the scan for runtime roots first, since it's
+           typically the slowest. */
+        while (pool.haveIdleWorker() && (runtimeTodo || !todo.empty())) {
+            unsigned int id = nextId++;
+            if (runtimeTodo) {
+                runtimeTodo = false;
+                pool.submit((format("%1% runtime") % id).str());
+                continue;
+            }
+            RootScanItem item = todo.front();
+            todo.pop_front();
+            string key = "-";
+            if (useCache) {
+                RootsCache::iterator i = rootsCache.find(item.path);
+                if (i != rootsCache.end()) key = *++splitFields(i->second).begin();
             }
+            running[id] = item;
+            string request = (format("%1% scan %2% %3%") % id % key % item.path).str();
+            if (hasNewline(item.path))
+                localReplies.push_back(std::pair<string, string>(request, localHandler(request)));
+            else
+                pool.submit(request);
+        }
+
+        string request, reply;
+        if (!localReplies.empty()) {
+            request = localReplies.front().first;
+            reply = localReplies.front().second;
+            localReplies.pop_front();
+        } else
+            pool.getReply(request, reply);
+        unsigned int id;
+        if (!string2Int(string(request, 0, request.find(' ')), id)) abort();
+
+        Strings fields = splitFields(reply);
+        if (fields.empty()) throw Error(format("bad reply to `%1%'") % request);
+        string type = fields.front();
+        fields.pop_front();
+
+        if (type == "w") {
+            localReplies.push_back(std::pair<string, string>(request, localHandler(request)));
+            continue;
+        }
+
+        if (type == "r") {
+            foreach (Strings::iterator, i, fields)
+                if (store->isValidPath(*i)) {
+                    debug(format("got additional root `%1%'") % *i);
+                    runtimeRoots.insert(*i);
+                }
+            printMsg(lvlInfo, format("found %1% runtime roots in %2$.2f s")
+                % runtimeRoots.size() % (getTime() - startTime));
+            continue;
+        }
+
+        if (running.find(id) == running.end()) {
+            assert(type == "e");
+            throw Error(fields.back());
+        }
+
+        RootScanItem item = running[id];
+        running.erase(id);
+        scanTime = getTime() - startTime;
+
+        if (type == "c") {
+            reply = rootsCache[item.path];
+            fields = splitFields(reply);
+            type = fields.front();
+            fields.pop_front();
+            nrCached++;
+        }
+
+        if (type == "d") {
+            nrDirs++;
+            if (useCache && isCacheable(fields.front(), now))
+                newCache[item.path] = reply;
+            fields.pop_front();
+            while (!fields.empty()) {
+                string kind = fields.front(); fields.pop_front();
+                Path path = item.path + "/" + fields.front(); fields.pop_front();
+                if (kind == "d")
+                    todo.push_back(RootScanItem(path, item.recurseSymlinks, ""));
+                else {
+                    foundRootLink(path, fields.front(), item.recurseSymlinks, roots, todo);
+                    fields.pop_front();
+                }
+            }
+        }
+
+        else if (type == "l")
+            foundRootLink(item.path, fields.front(), item.recurseSymlinks, roots, todo);
+
+        else if (type == "e") {
+            int errNo = atoi(fields.front().c_str());
+            if (!item.link.empty() && errNo == ENOENT) {
+                if (deleteStale) {
+                    printMsg(lvlInfo, format("removing stale link from `%1%' to `%2%'") % item.link % item.path);
+                    /* Note that we only delete when recursing, i.e.,
+                       when we are still in the `gcroots' tree.  We
+                       never delete stuff outside that tree. */
+                    unlink(item.link.c_str());
+                }
+            }
+            /* We only ignore permanent failures. */
+            else if (errNo == EACCES || errNo == ENOENT || errNo == ENOTDIR)
+                printMsg(lvlInfo, format("cannot read potential root `%1%'") % item.path);
+            else
+                throw Error(fields.back());
         }
     }
+
+    printMsg(lvlInfo, format("found %1% roots in `%2%' in %3$.2f s (%4% directories, %5% unchanged)")
+        % roots.size() % rootsDir % scanTime % nrDirs % nrCached);
+
+    if (useCache) {
+        rootsCache = newCache;
+        saveRootsCache();
+    }
+}
+
+
+Roots LocalStore::findRoots()
+{
+    Roots roots;
+    PathSet runtimeRoots;
+    scanRoots(false, false, roots, runtimeRoots);
+    return roots;
 }
 
 
@@ -402,26 +1073,19 @@ Paths topoSortPaths(const PathSet & paths)
 }
 
 
-struct GCLimitReached { };
-
-
 struct LocalStore::GCState
 {
     GCOptions options;
     GCResults & results;
     PathSet roots;
     PathSet tempRoots;
-    PathSet deleted;
     PathSet live;
-    PathSet busy;
+    FDs tempRootFDs; // read locks on the temporary root files
+    unsigned long long storeSize; // sum of the NAR sizes of valid paths
     bool gcKeepOutputs;
     bool gcKeepDerivations;
 
-    bool drvsIndexed;
-    typedef std::multimap<string, Path> DrvsByName;
-    DrvsByName drvsByName; // derivation paths hashed by name attribute
-
-    GCState(GCResults & results_) : results(results_), drvsIndexed(false)
+    GCState(GCResults & results_) : results(results_), storeSize(0)
     {
     }
 };
@@ -442,167 +1106,293 @@ bool LocalStore::isActiveTempFile(const GCState & state,
 }
 
 
-/* Return all the derivations in the Nix store that have `path' as an
-   output.  This function assumes that derivations have the same name
-   as their outputs. */
-PathSet LocalStore::findDerivers(GCState & state, const Path & path)
+/* Find the permanent, runtime and temporary roots.  The caller must
+   hold the GC lock. */
+void LocalStore::findRoots(GCState & state)
 {
-    PathSet derivers;
+    state.roots.clear();
+    state.tempRoots.clear();
+    state.tempRootFDs.clear();
 
-    Path deriver = queryDeriver(path);
-    if (deriver != "") derivers.insert(deriver);
+    /* Find the roots.  Since we've grabbed the GC lock, the set of
+       permanent roots cannot increase now. */
+    printMsg(lvlError, format("finding garbage collector roots..."));
 
-    if (!state.drvsIndexed) {
-        Paths entries = readDirectory(nixStore);
-        foreach (Paths::iterator, i, entries)
-            if (isDerivation(*i))
-                state.drvsByName.insert(std::pair<string, Path>(
-                        getNameOfStorePath(*i), nixStore + "/" + *i));
-        state.drvsIndexed = true;
+    /* Also add the paths in use by running programs (or returned by
+       the program specified by the NIX_ROOT_FINDER environment
+       variable) to the set of roots, to prevent them from being
+       garbage collected. */
+    if (!state.options.ignoreLiveness) {
+        Roots rootMap;
+        PathSet runtimeRoots;
+        scanRoots(true, true, rootMap, runtimeRoots);
+        foreach (Roots::iterator, i, rootMap) state.roots.insert(i->second);
+        state.roots.insert(runtimeRoots.begin(), runtimeRoots.end());
     }
-    
-    string name = getNameOfStorePath(path);
 
-    // Urgh, I should have used Haskell...
-    std::pair<GCState::DrvsByName::iterator, GCState::DrvsByName::iterator> range =
-        state.drvsByName.equal_range(name);
+    /* Read the temporary roots.  This acquires read locks on all
+       per-process temporary root files, and makes processes that add
+       roots to the shared registry wait for the GC lock.  So after
+       this point no paths can be added to the set of temporary
+       roots. */
+    double startTime = getTime();
+    readTempRoots(state.tempRoots, state.tempRootFDs);
+    state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+    printMsg(lvlInfo, format("found %1% temporary roots in %2$.2f s")
+        % state.tempRoots.size() % (getTime() - startTime));
+}
+
+
+/* Compute the set of live paths, i.e., everything reachable from the
+   roots.  Besides the references of a path, the edges followed are:
+   if gc-keep-outputs is set, from a derivation to its outputs; and if
+   gc-keep-derivations is set, from an output to the derivations that
+   produce it.  Both are looked up in the DerivationOutputs table.  Every
+   valid path is visited at most once.  Paths that are already in
+   `state.live' are not visited again, so after finding the roots
+   again, this only marks what has become reachable since. */
+void LocalStore::markLive(GCState & state)
+{
+    std::queue<Path> todo;
+    foreach (PathSet::iterator, i, state.roots)
+        if (state.live.insert(*i).second) todo.push(*i);
+
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        Path path = todo.front();
+        todo.pop();
+
+        /* Roots that aren't valid (e.g. temporary roots of paths
+           being built) are live, but have no outgoing edges. */
+        if (!isValidPath(path)) continue;
+
+        PathSet next;
+        queryReferences(path, next);
+
+        if (state.gcKeepOutputs && isDerivation(path)) {
+            PathSet outputs = queryDerivationOutputs(path);
+            next.insert(outputs.begin(), outputs.end());
+        }
 
-    for (GCState::DrvsByName::iterator i = range.first; i != range.second; ++i)
-        if (isValidPath(i->second)) {
-            Derivation drv = derivationFromPath(i->second);
-            foreach (DerivationOutputs::iterator, j, drv.outputs)
-                if (j->second.path == path) derivers.insert(i->second);
+        if (state.gcKeepDerivations) {
+            PathSet derivers = queryValidDerivers(path);
+            next.insert(derivers.begin(), derivers.end());
         }
 
-    return derivers;
+        foreach (PathSet::iterator, i, next)
+            if (state.live.insert(*i).second) {
+                debug(format("`%1%' is live") % *i);
+                todo.push(*i);
+            }
+    }
 }
 
-    
-bool LocalStore::tryToDelete(GCState & state, const Path & path)
+
+/* Deletes store paths on behalf of sweep().  Replies are `ok
+   <bytes-freed> <blocks-freed>' or `error <message>'. */
+struct DeletePathHandler : WorkerHandler
+{
+    string operator () (const string & path)
+    {
+        try {
+            unsigned long long bytesFreed, blocksFreed;
+            deletePathWrapped(path, bytesFreed, blocksFreed);
+            return (format("ok %1% %2%") % bytesFreed % blocksFreed).str();
+        } catch (Error & e) {
+            return "error " + e.msg();
+        }
+    }
+};
+
+
+/* Remove the entries in the content index of the optimiser whose
+   files are no longer used by any path in the store, i.e., whose link
+   count has dropped to 1.  Only then is their disk space actually
+   freed. */
+void LocalStore::removeUnusedLinks(GCState & state)
 {
-    if (!pathExists(path)) return true;
-    if (state.deleted.find(path) != state.deleted.end()) return true;
-    if (state.live.find(path) != state.live.end()) return false;
+    if (!pathExists(linksDir)) return;
 
-    startNest(nest, lvlDebug, format("considering whether to delete `%1%'") % path);
+    unsigned long long bytesFreed = 0, blocksFreed = 0;
+    unsigned int removed = 0;
 
-    if (state.roots.find(path) != state.roots.end()) {
-        printMsg(lvlDebug, format("cannot delete `%1%' because it's a root") % path);
-        goto isLive;
+    Strings names = readDirectory(linksDir);
+    foreach (Strings::iterator, i, names) {
+        checkInterrupt();
+        Path path = linksDir + "/" + *i;
+        /* The optimiser may rename entries concurrently. */
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1) {
+            if (errno == ENOENT) continue;
+            throw SysError(format("getting attributes of path `%1%'") % path);
+        }
+        if (st.st_nlink != 1) continue;
+        printMsg(lvlTalkative, format("deleting unused link `%1%'") % path);
+        if (unlink(path.c_str()) == -1) {
+            if (errno == ENOENT) continue;
+            throw SysError(format("deleting `%1%'") % path);
+        }
+        bytesFreed += st.st_size;
+        blocksFreed += st.st_blocks;
+        removed++;
     }
 
-    if (isValidPath(path)) {
+    state.results.bytesFreed += bytesFreed;
+    state.results.blocksFreed += blocksFreed;
 
-        /* Recursively try to delete the referrers of this path.  If
-           any referrer can't be deleted, then this path can't be
-           deleted either. */
-        PathSet referrers;
-        queryReferrers(path, referrers);
-        foreach (PathSet::iterator, i, referrers)
-            if (*i != path && !tryToDelete(state, *i)) {
-                printMsg(lvlDebug, format("cannot delete `%1%' because it has live referrers") % path);
-                goto isLive;
-            }
+    printMsg(lvlInfo, format("deleted %1% unused links, freeing %2% bytes")
+        % removed % bytesFreed);
+}
 
-        /* If gc-keep-derivations is set and this is a derivation,
-           then don't delete the derivation if any of the outputs are
-           live. */
-        if (state.gcKeepDerivations && isDerivation(path)) {
-            Derivation drv = derivationFromPath(path);
-            foreach (DerivationOutputs::iterator, i, drv.outputs)
-                if (!tryToDelete(state, i->second.path)) {
-                    printMsg(lvlDebug, format("cannot delete derivation `%1%' because its output is alive") % path);
-                    goto isLive;
-                }
+
+/* Check whether the collector should stop deleting paths. */
+bool LocalStore::limitsReached(GCState & state)
+{
+    GCOptions & options(state.options);
+
+    if (options.maxFreed && state.results.bytesFreed > options.maxFreed) {
+        printMsg(lvlInfo, format("deleted more than %1% bytes; stopping") % options.maxFreed);
+        return true;
+    }
+
+    if (options.maxLinks) {
+        struct stat st;
+        if (stat(nixStore.c_str(), &st) == -1)
+            throw SysError(format("statting `%1%'") % nixStore);
+        if (st.st_nlink < options.maxLinks) {
+            printMsg(lvlInfo, format("link count on the store has dropped below %1%; stopping") % options.maxLinks);
+            return true;
         }
+    }
 
-        /* If gc-keep-derivations and gc-keep-outputs are both set,
-           it's possible that the path has already been deleted (due
-           to the recursion below), so bail out. */
-        if (!pathExists(path)) return true;
-
-        /* If gc-keep-outputs is set, then don't delete this path if
-           its deriver is not garbage.  !!! Nix does not reliably
-           store derivers, so we have to look at all derivations to
-           determine which of them derive `path'.  Since this makes
-           the garbage collector very slow to start on large Nix
-           stores, here we just look for all derivations that have the
-           same name as `path' (where the name is the part of the
-           filename after the hash, i.e. the `name' attribute of the
-           derivation).  This is somewhat hacky: currently, the
-           deriver of a path always has the same name as the output,
-           but this might change in the future. */
-        if (state.gcKeepOutputs) {
-            PathSet derivers = findDerivers(state, path);
-            foreach (PathSet::iterator, deriver, derivers) {
-                /* Break an infinite recursion if gc-keep-derivations
-                   and gc-keep-outputs are both set by tentatively
-                   assuming that this path is garbage.  This is a safe
-                   assumption because at this point, the only thing
-                   that can prevent it from being garbage is the
-                   deriver.  Since tryToDelete() works "upwards"
-                   through the dependency graph, it won't encouter
-                   this path except in the call to tryToDelete() in
-                   the gc-keep-derivation branch. */
-                state.deleted.insert(path);
-                if (!tryToDelete(state, *deriver)) {
-                    state.deleted.erase(path);
-                    printMsg(lvlDebug, format("cannot delete `%1%' because its deriver `%2%' is alive") % path % *deriver);
-                    goto isLive;
-                }
-            }
+    if (options.minFree) {
+        struct statvfs st;
+        if (statvfs(nixStore.c_str(), &st) == -1)
+            throw SysError(format("statting file system of `%1%'") % nixStore);
+        if ((unsigned long long) st.f_bavail * st.f_frsize >= options.minFree) {
+            printMsg(lvlInfo, format("at least %1% bytes are free; stopping") % options.minFree);
+            return true;
         }
     }
 
-    else {
+    if (options.maxStoreSize && state.storeSize <= options.maxStoreSize) {
+        printMsg(lvlInfo, format("the store is no larger than %1% bytes; stopping") % options.maxStoreSize);
+        return true;
+    }
 
-        /* A lock file belonging to a path that we're building right
-           now isn't garbage. */
-        if (isActiveTempFile(state, path, ".lock")) return false;
+    return false;
+}
 
-        /* Don't delete .chroot directories for derivations that are
-           currently being built. */
-        if (isActiveTempFile(state, path, ".chroot")) return false;
 
+/* Delete (or report) the dead paths in `dead', which must be ordered
+   so that referrers come before their references.  The paths are
+   invalidated in that order, but the deletion of their contents is
+   done by up to `gc-delete-jobs' worker processes in parallel.  When
+   a limit is reached, no new deletions are started, but those in
+   progress are allowed to finish.  Paths are removed from `dead' as
+   they are processed.  In incremental mode, this returns true when
+   the slice is over but there is more garbage to delete. */
+bool LocalStore::sweep(GCState & state, Paths & dead)
+{
+    if (!doDelete(state.options.action)) {
+        foreach (Paths::const_iterator, i, dead)
+            if (pathExists(*i)) {
+                printMsg(lvlTalkative, format("would delete `%1%'") % *i);
+                state.results.paths.insert(*i);
+            }
+        return false;
     }
 
-    /* The path is garbage, so delete it. */
-    if (doDelete(state.options.action)) {
-        printMsg(lvlInfo, format("deleting `%1%'") % path);
+    unsigned int jobs = queryIntSetting("gc-delete-jobs", 1);
+    DeletePathHandler handler;
+    WorkerPool pool(handler, jobs > 1 ? jobs : 0);
+
+    /* Requests are lines, so paths with newlines in their names are
+       deleted in this process.  These are their replies. */
+    std::list<std::pair<Path, string> > localReplies;
+
+    bool limitReached = limitsReached(state), sliceDone = false;
+    double sliceStart = getTime();
+    unsigned long long sliceFreed = state.results.bytesFreed;
+
+    while (true) {
+        checkInterrupt();
+
+        if (state.options.sliceTime && getTime() - sliceStart >= state.options.sliceTime)
+            sliceDone = true;
+
+        while (!limitReached && !sliceDone && !dead.empty() && pool.haveIdleWorker()) {
+            Path path = dead.front();
+            dead.pop_front();
+            if (!pathExists(path)) continue;
 
+            /* In incremental mode, the path may have become
+               reachable since the slice before. */
+            if (state.live.find(path) != state.live.end()) continue;
+
+            /* A path can still acquire referrers if it was added as
+               a temporary root after the roots were determined (and
+               that can only happen in incremental mode), so treat
+               paths in use as live. */
+            unsigned long long narSize = isValidPath(path) ? queryPathInfo(path).narSize : 0;
+
+            try {
+                invalidatePathChecked(path);
+            } catch (PathInUse & e) {
+                printMsg(lvlInfo, format("not deleting `%1%' since it is in use") % path);
+                continue;
+            }
+
+            printMsg(lvlInfo, format("deleting `%1%'") % path);
+            state.storeSize -= std::min(state.storeSize, narSize);
+            if (path.find('\n') != string::npos) {
+                localReplies.push_back(std::pair<Path, string>(path, handler(path)));
+                break; /* check the limits first */
+            }
+            pool.submit(path);
+        }
+
+        string path, reply;
+        if (!localReplies.empty()) {
+            path = localReplies.front().first;
+            reply = localReplies.front().second;
+            localReplies.pop_front();
+        } else if (pool.busy())
+            pool.getReply(path, reply);
+        else
+            break;
+
+        Strings ss = tokenizeString(reply);
         unsigned long long bytesFreed, blocksFreed;
-        deleteFromStore(path, bytesFreed, blocksFreed);
-        state.results.bytesFreed += bytesFreed;
-        state.results.blocksFreed += blocksFreed;
 
-        if (state.options.maxFreed && state.results.bytesFreed > state.options.maxFreed) {
-            printMsg(lvlInfo, format("deleted more than %1% bytes; stopping") % state.options.maxFreed);
-            throw GCLimitReached();
+        if (ss.size() == 3 && ss.front() == "ok") {
+            ss.pop_front();
+            if (!string2Int(ss.front(), bytesFreed) || !string2Int(ss.back(), blocksFreed))
+                throw Error(format("bad reply `%1%' from worker process") % reply);
+            state.results.bytesFreed += bytesFreed;
+            state.results.blocksFreed += blocksFreed;
+            state.results.paths.insert(path);
         }
 
-        if (state.options.maxLinks) {
-            struct stat st;
-            if (stat(nixStore.c_str(), &st) == -1)
-                throw SysError(format("statting `%1%'") % nixStore);
-            if (st.st_nlink < state.options.maxLinks) {
-                printMsg(lvlInfo, format("link count on the store has dropped below %1%; stopping") % state.options.maxLinks);
-                throw GCLimitReached();
-            }
+        /* The path has already been invalidated, so the next
+           collection will try again. */
+        else if (string(reply, 0, 6) == "error ") {
+            printMsg(lvlError, format("error: %1%") % string(reply, 6));
+            continue;
         }
-        
-    } else
-        printMsg(lvlTalkative, format("would delete `%1%'") % path);
-    
-    state.deleted.insert(path);
-    if (state.options.action != GCOptions::gcReturnLive)
-        state.results.paths.insert(path);
-    return true;
 
- isLive:
-    state.live.insert(path);
-    if (state.options.action == GCOptions::gcReturnLive)
-        state.results.paths.insert(path);
-    return false;
+        else throw Error(format("bad reply `%1%' from worker process") % reply);
+
+        if (!limitReached) limitReached = limitsReached(state);
+
+        if (state.options.sliceBytes && state.results.bytesFreed - sliceFreed >= state.options.sliceBytes)
+            sliceDone = true;
+    }
+
+    pool.shutdown();
+
+    return sliceDone && !limitReached && !dead.empty();
 }
 
 
@@ -613,71 +1403,142 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     
     state.gcKeepOutputs = queryBoolSetting("gc-keep-outputs", false);
     state.gcKeepDerivations = queryBoolSetting("gc-keep-derivations", true);
+
+    if (options.maxStoreSize) state.storeSize = queryStoreSize();
     
     /* Acquire the global GC root.  This prevents
        a) New roots from being added.
        b) Processes from creating new temporary root files. */
     AutoCloseFD fdGCLock = openGCLock(ltWrite);
+    GCActiveGuard gcActiveGuard;
 
-    /* Find the roots.  Since we've grabbed the GC lock, the set of
-       permanent roots cannot increase now. */
-    printMsg(lvlError, format("finding garbage collector roots..."));
-    Roots rootMap = options.ignoreLiveness ? Roots() : nix::findRoots(true);
-
-    foreach (Roots::iterator, i, rootMap) state.roots.insert(i->second);
-
-    /* Add additional roots returned by the program specified by the
-       NIX_ROOT_FINDER environment variable.  This is typically used
-       to add running programs to the set of roots (to prevent them
-       from being garbage collected). */
-    if (!options.ignoreLiveness)
-        addAdditionalRoots(state.roots);
-
-    /* Read the temporary roots.  This acquires read locks on all
-       per-process temporary root files.  So after this point no paths
-       can be added to the set of temporary roots. */
-    FDs fds;
-    readTempRoots(state.tempRoots, fds);
-    state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+    findRoots(state);
 
     /* After this point the set of roots or temporary roots cannot
        increase, since we hold locks on everything.  So everything
-       that is not reachable from `roots'. */
-
-    /* Now either delete all garbage paths, or just the specified
-       paths (for gcDeleteSpecific). */
+       that is not reachable from `roots' is garbage. */
+
+    /* Mark phase: compute the live paths. */
+    printMsg(lvlError, format("determining live paths..."));
+    double startTime = getTime();
+    markLive(state);
+    double markTime = getTime() - startTime;
+    printMsg(lvlInfo, format("mark phase: found %1% live paths in %2$.2f s")
+        % state.live.size() % markTime);
+
+    /* Sweep phase: either delete all garbage paths, or just the
+       specified paths (for gcDeleteSpecific). */
+    startTime = getTime();
+    PathSet dead;
+    vector<Path> order;
 
     if (options.action == GCOptions::gcDeleteSpecific) {
 
+        /* Deleting a path requires deleting its referrers first.
+           These are necessarily dead if the path itself is dead. */
         foreach (PathSet::iterator, i, options.pathsToDelete) {
             assertStorePath(*i);
-            if (!tryToDelete(state, *i))
+            if (state.live.find(*i) != state.live.end())
                 throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
+            computeFSClosure(*i, dead, true);
         }
+        order.insert(order.end(), dead.begin(), dead.end());
         
     } else {
         
         printMsg(lvlError, format("reading the Nix store..."));
         Paths entries = readDirectory(nixStore);
 
-        /* Randomise the order in which we delete entries to make the
-           collector less biased towards deleting paths that come
-           alphabetically first (e.g. /nix/store/000...).  This
-           matters when using --max-freed etc. */
-        vector<Path> entries_(entries.begin(), entries.end());
-        random_shuffle(entries_.begin(), entries_.end());
+        foreach (Paths::iterator, i, entries) {
+            Path path = canonPath(nixStore + "/" + *i);
+
+            /* The content index of the optimiser is cleaned up
+               separately by removeUnusedLinks(). */
+            if (path == linksDir) continue;
+
+            if (state.live.find(path) != state.live.end()) {
+                if (options.action == GCOptions::gcReturnLive)
+                    results.paths.insert(path);
+                continue;
+            }
+
+            /* A lock file belonging to a path that we're building
+               right now isn't garbage, and neither are the .chroot
+               directories of derivations that are being built. */
+            if (isActiveTempFile(state, path, ".lock") ||
+                isActiveTempFile(state, path, ".chroot"))
+                continue;
+
+            dead.insert(path);
+            order.push_back(path);
+        }
+
+        /* Delete the least recently used paths first.  This matters
+           when using --max-freed etc.  Since dfsVisit() below
+           prepends paths, start with the most recently used ones.
+           Entries that aren't valid paths go first. */
+        if (doDelete(options.action)) {
+            flushUsedPaths();
+            std::map<Path, time_t> lastUsed;
+            queryLastUsed(lastUsed);
+            vector<std::pair<time_t, Path> > byTime;
+            foreach (vector<Path>::iterator, i, order) {
+                std::map<Path, time_t>::iterator j = lastUsed.find(*i);
+                byTime.push_back(std::pair<time_t, Path>(j == lastUsed.end() ? 0 : j->second, *i));
+            }
+            sort(byTime.begin(), byTime.end());
+            order.clear();
+            for (vector<std::pair<time_t, Path> >::reverse_iterator i = byTime.rbegin(); i != byTime.rend(); ++i)
+                order.push_back(i->second);
+        }
+    }
+
+    if (options.action != GCOptions::gcReturnLive) {
+
+        /* Sort the dead paths such that referrers come before their
+           references, since a path can only be deleted if it has no
+           referrers.  That doesn't matter if we're only reporting
+           them. */
+        Paths sorted;
+        if (doDelete(options.action)) {
+            PathSet visited;
+            foreach (vector<Path>::iterator, i, order)
+                dfsVisit(dead, *i, visited, sorted);
+        } else
+            sorted.insert(sorted.end(), order.begin(), order.end());
 
         if (doDelete(state.options.action))
             printMsg(lvlError, format("deleting garbage..."));
-        else
-            printMsg(lvlError, format("determining live/dead paths..."));
     
-        try {
-            foreach (vector<Path>::iterator, i, entries_)
-                tryToDelete(state, canonPath(nixStore + "/" + *i));
-        } catch (GCLimitReached & e) {
+        /* In incremental mode, sweep() returns after each slice.
+           Then release the locks, so that builds waiting for them can
+           proceed, and reacquire them.  Roots may have been added in
+           the meantime, so find them again and mark anything newly
+           reachable as live. */
+        while (sweep(state, sorted)) {
+            clearGCActive();
+            state.tempRootFDs.clear();
+            fdGCLock.close();
+            printMsg(lvlInfo, format("released the garbage collector lock; %1% paths to go")
+                % sorted.size());
+            sleep(1);
+            fdGCLock = openGCLock(ltWrite);
+            findRoots(state);
+            markLive(state);
         }
-    }        
+
+        if (doDelete(state.options.action)) removeUnusedLinks(state);
+    }
+
+    double sweepTime = getTime() - startTime;
+    printMsg(lvlInfo, format("sweep phase: %1% %2% paths in %3$.2f s")
+        % (doDelete(options.action) ? "deleted" : "found")
+        % results.paths.size() % sweepTime);
+
+    /* Invalidating many paths can leave a large write-ahead log
+       behind, so merge it into the database now. */
+    if (doDelete(state.options.action) && !state.results.paths.empty())
+        checkpointDB();
 }
 
 
@@ -21,7 +21,7 @@ extern string nixLogDir;
 /* nixStateDir is the directory where state is stored. */
 extern string nixStateDir;
 
-/* nixDBPath is the path name of our Berkeley DB environment. */
+/* nixDBPath is the directory containing the Nix database. */
 extern string nixDBPath;
 
 /* nixConfDir is the directory where configuration files are
@@ -2,23 +2,259 @@
 #include "local-store.hh"
 #include "globals.hh"
 #include "archive.hh"
+#include "compression.hh"
 #include "pathlocks.hh"
 #include "worker-protocol.hh"
+#include "derivations.hh"
+#include "worker-pool.hh"
     
 #include <iostream>
 #include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 
+#include <sqlite3.h>
+
 
 namespace nix {
 
+
+MakeError(SQLiteError, Error);
+
+
+static void throwSQLiteError(sqlite3 * db, const format & f)
+    __attribute__ ((noreturn));
+
+static void throwSQLiteError(sqlite3 * db, const format & f)
+{
+    throw SQLiteError(format("%1%: %2%") % f.str() % sqlite3_errmsg(db));
+}
+
+
+SQLite::~SQLite()
+{
+    try {
+        if (db && sqlite3_close(db) != SQLITE_OK)
+            throwSQLiteError(db, "closing database");
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void SQLiteStmt::create(sqlite3 * db, const string & s)
+{
+    checkInterrupt();
+    assert(!stmt);
+    if (sqlite3_prepare_v2(db, s.c_str(), -1, &stmt, 0) != SQLITE_OK)
+        throwSQLiteError(db, "creating statement");
+    this->db = db;
+}
+
+
+void SQLiteStmt::reset()
+{
+    assert(stmt);
+    /* Note: sqlite3_reset() returns the error code for the most
+       recent call to sqlite3_step().  So ignore it. */
+    sqlite3_reset(stmt);
+    curArg = 1;
+}
+
+
+SQLiteStmt::~SQLiteStmt()
+{
+    try {
+        if (stmt && sqlite3_finalize(stmt) != SQLITE_OK)
+            throwSQLiteError(db, "finalizing statement");
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void SQLiteStmt::bind(const string & value)
+{
+    if (sqlite3_bind_text(stmt, curArg++, value.c_str(), -1, SQLITE_TRANSIENT) != SQLITE_OK)
+        throwSQLiteError(db, "binding argument");
+}
+
+
+void SQLiteStmt::bind(int value)
+{
+    if (sqlite3_bind_int(stmt, curArg++, value) != SQLITE_OK)
+        throwSQLiteError(db, "binding argument");
+}
+
+
+void SQLiteStmt::bind64(long long value)
+{
+    if (sqlite3_bind_int64(stmt, curArg++, value) != SQLITE_OK)
+        throwSQLiteError(db, "binding argument");
+}
+
+
+void SQLiteStmt::bind()
+{
+    if (sqlite3_bind_null(stmt, curArg++) != SQLITE_OK)
+        throwSQLiteError(db, "binding argument");
+}
+
+
+/* Helper class to ensure that prepared statements are reset when
+   leaving the scope that uses them.  Unfinished prepared statements
+   prevent transactions from being aborted, and can cause locks to be
+   kept when they should be released. */
+struct SQLiteStmtUse
+{
+    SQLiteStmt & stmt;
+    SQLiteStmtUse(SQLiteStmt & stmt) : stmt(stmt)
+    {
+        stmt.reset();
+    }
+    ~SQLiteStmtUse()
+    {
+        try {
+            stmt.reset();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+};
+
+
+/* RAII helper for a database transaction.  The transaction is rolled
+   back unless commit() is called.  `begin immediate' acquires the
+   database write lock right away, so that concurrent writers are
+   serialised here rather than failing halfway through. */
+struct SQLiteTxn 
+{
+    bool active;
+    sqlite3 * db;
+    
+    SQLiteTxn(sqlite3 * db) : active(false) {
+        this->db = db;
+        if (sqlite3_exec(db, "begin immediate transaction;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "starting transaction");
+        active = true;
+    }
+
+    void commit() 
+    {
+        if (sqlite3_exec(db, "commit;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "committing transaction");
+        active = false;
+    }
+    
+    ~SQLiteTxn() 
+    {
+        try {
+            if (active && sqlite3_exec(db, "rollback;", 0, 0, 0) != SQLITE_OK)
+                throwSQLiteError(db, "aborting transaction");
+        } catch (...) {
+            ignoreException();
+        }
+    }
+};
+
+
+PathInfoCache::PathInfoCache()
+    : maxBytes(0), curBytes(0), peakBytes(0)
+    , hits(0), misses(0), evictions(0)
+{
+}
+
+
+void PathInfoCache::setMaxBytes(unsigned long long maxBytes)
+{
+    this->maxBytes = maxBytes;
+    evict();
+}
+
+
+/* Rough estimate of the memory used by a cache entry: the strings,
+   plus the overhead of a map and a list node for the entry itself
+   and a set node for each reference. */
+static unsigned long long entryBytes(const ValidPathInfo & info)
+{
+    const unsigned long long nodeOverhead = 48;
+    unsigned long long n = sizeof(ValidPathInfo) + 2 * info.path.size()
+        + info.deriver.size() + 3 * nodeOverhead;
+    foreach (PathSet::const_iterator, i, info.references)
+        n += sizeof(Path) + i->size() + nodeOverhead;
+    return n;
+}
+
+
+bool PathInfoCache::lookup(const Path & path, ValidPathInfo & info)
+{
+    Entries::iterator i = entries.find(path);
+    if (i == entries.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, i->second.lruPos);
+    info = i->second.info;
+    return true;
+}
+
+
+void PathInfoCache::insert(const ValidPathInfo & info)
+{
+    erase(info.path);
+    if (maxBytes == 0) return;
+    Entry & e(entries[info.path]);
+    e.info = info;
+    e.bytes = entryBytes(info);
+    lru.push_front(info.path);
+    e.lruPos = lru.begin();
+    curBytes += e.bytes;
+    if (curBytes > peakBytes) peakBytes = curBytes;
+    evict();
+}
+
+
+void PathInfoCache::erase(const Path & path)
+{
+    Entries::iterator i = entries.find(path);
+    if (i == entries.end()) return;
+    curBytes -= i->second.bytes;
+    lru.erase(i->second.lruPos);
+    entries.erase(i);
+}
+
+
+void PathInfoCache::evict()
+{
+    while (curBytes > maxBytes && !lru.empty()) {
+        erase(lru.back());
+        evictions++;
+    }
+}
+
+
+void PathInfoCache::printStats() const
+{
+    bool showStats = getEnv("NIX_SHOW_STATS", "0") != "0";
+    Verbosity v = showStats ? lvlInfo : lvlDebug;
+    printMsg(v, "path info cache statistics:");
+    printMsg(v, format("  hits: %1%") % hits);
+    printMsg(v, format("  misses: %1%") % misses);
+    printMsg(v, format("  hit rate: %1%%%")
+        % (hits + misses ? hits * 100.0 / (hits + misses) : 0.0));
+    printMsg(v, format("  evictions: %1%") % evictions);
+    printMsg(v, format("  entries: %1% (%2% bytes, peak %3% bytes, limit %4% bytes)")
+        % entries.size() % curBytes % peakBytes % maxBytes);
+}
+
     
 void checkStoreNotSymlink()
 {
@@ -41,16 +277,21 @@ void checkStoreNotSymlink()
 LocalStore::LocalStore()
 {
     substitutablePathsLoaded = false;
+
+    pathInfoCache.setMaxBytes(
+        (unsigned long long) queryIntSetting("path-info-cache-size", 32) << 20);
     
     schemaPath = nixDBPath + "/schema";
+    linksDir = nixStore + "/.links";
     
-    if (readOnlyMode) return;
+    if (readOnlyMode) {
+        openDB(false);
+        return;
+    }
 
     /* Create missing state directories if they don't already exist. */
     createDirs(nixStore);
-    createDirs(nixDBPath + "/info");
-    createDirs(nixDBPath + "/referrer");
-    createDirs(nixDBPath + "/failed");
+    createDirs(nixDBPath);
     Path profilesDir = nixStateDir + "/profiles";
     createDirs(nixStateDir + "/profiles");
     createDirs(nixStateDir + "/temproots");
@@ -63,12 +304,15 @@ LocalStore::LocalStore()
   
     checkStoreNotSymlink();
 
+    /* Acquire the big fat lock in shared mode to make sure that no
+       schema upgrade is in progress. */
     try {
         Path globalLockPath = nixDBPath + "/big-lock";
         globalLock = openLockFile(globalLockPath.c_str(), true);
     } catch (SysError & e) {
         if (e.errNo != EACCES) throw;
         readOnlyMode = true;
+        openDB(false);
         return;
     }
     
@@ -76,33 +320,67 @@ LocalStore::LocalStore()
         printMsg(lvlError, "waiting for the big Nix store lock...");
         lockFile(globalLock, ltRead, true);
     }
-    
+
+    /* Check the current database schema and if necessary do an
+       upgrade.  */
     int curSchema = getSchema();
     if (curSchema > nixSchemaVersion)
         throw Error(format("current Nix store schema is version %1%, but I only support %2%")
             % curSchema % nixSchemaVersion);
-    if (curSchema == 0) { /* new store */
-        curSchema = nixSchemaVersion; 
+    
+    else if (curSchema == 0) { /* new store */
+        curSchema = nixSchemaVersion;
+        openDB(true);
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
     }
-    if (curSchema == 1) throw Error("your Nix store is no longer supported");
-    if (curSchema < nixSchemaVersion) upgradeStore12();
+    
+    else if (curSchema < nixSchemaVersion) {
+        if (curSchema < 5)
+            throw Error(
+                "Your Nix store has a database in Berkeley DB format,\n"
+                "which is no longer supported. To convert to the new format,\n"
+                "please upgrade Nix to version 0.12 first.");
+        
+        /* Upgrade requires exclusive access to the store. */
+        if (!lockFile(globalLock, ltWrite, false)) {
+            printMsg(lvlError, "waiting for exclusive access to the Nix store...");
+            lockFile(globalLock, ltWrite, true);
+        }
+
+        /* Get the schema version again, because another process may
+           have performed the upgrade already. */
+        curSchema = getSchema();
+
+        if (curSchema < 6) upgradeStore6();
+        else {
+            if (curSchema < 7) upgradeStore7();
+            if (curSchema < 8) upgradeStore8();
+            if (curSchema < 10) upgradeStore10();
+            /* Creating the database creates any missing tables. */
+            openDB(true);
+            if (curSchema < 9) upgradeStore9();
+        }
+
+        writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
-    doFsync = queryBoolSetting("fsync-metadata", false);
+        lockFile(globalLock, ltRead, true);
+    }
+    
+    else openDB(false);
 }
 
 
 LocalStore::~LocalStore()
 {
     try {
-        flushDelayedUpdates();
-
         foreach (RunningSubstituters::iterator, i, runningSubstituters) {
             i->second.to.close();
             i->second.from.close();
             i->second.pid.wait(true);
         }
-                
+        flushUsedPaths();
+        flushOptimisedPaths();
+        pathInfoCache.printStats();
     } catch (...) {
         ignoreException();
     }
@@ -121,6 +399,116 @@ int LocalStore::getSchema()
 }
 
 
+void LocalStore::openDB(bool create)
+{
+    /* Open the Nix database. */
+    if (sqlite3_open_v2((nixDBPath + "/db.sqlite").c_str(), &db.db,
+            SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), 0) != SQLITE_OK)
+        throw Error("cannot open SQLite database");
+
+    /* Wait for other processes that are holding the database lock
+       rather than failing with SQLITE_BUSY. */
+    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(db, "setting timeout");
+
+    if (sqlite3_exec(db, "pragma foreign_keys = 1;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "enabling foreign keys");
+
+    /* Whether SQLite should fsync().  "Normal" synchronous mode
+       should be safe enough.  If the user asks for it, don't sync at
+       all.  This can cause database corruption if the system
+       crashes. */
+    string syncMode = queryBoolSetting("fsync-metadata", true) ? "normal" : "off";
+    if (sqlite3_exec(db, ("pragma synchronous = " + syncMode + ";").c_str(), 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting synchronous mode");
+
+    /* Set the SQLite journal mode.  In WAL (write-ahead log) mode,
+       changes are appended to a log that is merged into the database
+       by periodic checkpoints, and readers don't block writers (or
+       vice versa), so it's the default.  Otherwise use `truncate'
+       mode, which should be a bit faster than the default `delete'
+       mode.  Only change the mode if necessary, since that requires
+       a write lock on the database. */
+    string mode = queryBoolSetting("use-sqlite-wal", true) ? "wal" : "truncate";
+    string prevMode;
+    {
+        SQLiteStmt stmt;
+        stmt.create(db, "pragma main.journal_mode;");
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+            throwSQLiteError(db, "querying journal mode");
+        prevMode = string((const char *) sqlite3_column_text(stmt, 0));
+    }
+    if (prevMode != mode &&
+        sqlite3_exec(db, ("pragma main.journal_mode = " + mode + ";").c_str(), 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting journal mode");
+
+    /* Increase the auto-checkpoint interval to 8192 pages, so that
+       large batches of registrations don't each trigger a
+       checkpoint. */
+    if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 8192;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting autocheckpoint interval");
+
+    /* Access the database through a shared memory mapping of (at
+       most) `db-mmap-size' MiB.  Index lookups such as the validity
+       check in isValidPath() then read pages straight from the
+       kernel's page cache, which is shared between all Nix
+       processes, instead of copying them into a private SQLite page
+       cache in every process.  Older SQLite versions don't support
+       this. */
+#if SQLITE_VERSION_NUMBER >= 3007017
+    unsigned int mmapSize = queryIntSetting("db-mmap-size", 128);
+    string mmapPragma = (format("pragma mmap_size = %1%;") % ((unsigned long long) mmapSize << 20)).str();
+    if (sqlite3_exec(db, mmapPragma.c_str(), 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting memory map size");
+#endif
+
+    /* Initialise the database schema, if necessary. */
+    if (create) {
+#include "schema.sql.hh"
+        string s((const char *) schema, sizeof(schema));
+        if (sqlite3_exec(db, s.c_str(), 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "initialising database schema");
+    }
+
+    /* Prepare SQL statements. */
+    stmtRegisterValidPath.create(db,
+        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize) values (?, ?, ?, ?, ?);");
+    stmtUpdatePathInfo.create(db,
+        "update ValidPaths set lastVerified = (case when hash = ?1 then lastVerified end), "
+        "hash = ?1, deriver = ?2, narSize = coalesce(?3, narSize) where path = ?4;");
+    stmtAddReference.create(db,
+        "insert or replace into Refs (referrer, reference) values (?, ?);");
+    stmtQueryPathInfo.create(db,
+        "select id, hash, registrationTime, deriver, narSize from ValidPaths where path = ?;");
+    stmtQueryValidPath.create(db,
+        "select 1 from ValidPaths where path = ?;");
+    stmtQueryValidPathsAfter.create(db,
+        "select path from ValidPaths where path > ? order by path limit ?;");
+    stmtQueryReferences.create(db,
+        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+    stmtQueryReferrers.create(db,
+        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    stmtInvalidatePath.create(db,
+        "delete from ValidPaths where path = ?;");
+    stmtRegisterFailedPath.create(db,
+        "insert or ignore into FailedPaths (path, time) values (?, ?);");
+    stmtHasPathFailed.create(db,
+        "select time from FailedPaths where path = ?;");
+    stmtMarkVerified.create(db,
+        "update ValidPaths set lastVerified = ? where path = ?;");
+    stmtAddDerivationOutput.create(db,
+        "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
+    stmtQueryValidDerivers.create(db,
+        "select v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+    stmtQueryDerivationOutputs.create(db,
+        "select d.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where v.path = ?;");
+    stmtMarkUsed.create(db,
+        "update ValidPaths set lastUsed = ? where path = ? and (lastUsed is null or lastUsed < ?);");
+    stmtMarkOptimised.create(db,
+        "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
+}
+
+
 void canonicalisePathMetaData(const Path & path, bool recurse)
 {
     checkInterrupt();
@@ -195,181 +583,238 @@ void canonicalisePathMetaData(const Path & path)
 }
 
 
-static Path infoFileFor(const Path & path)
+unsigned long long LocalStore::addValidPath(const ValidPathInfo & info)
 {
-    string baseName = baseNameOf(path);
-    return (format("%1%/info/%2%") % nixDBPath % baseName).str();
+    SQLiteStmtUse use(stmtRegisterValidPath);
+    stmtRegisterValidPath.bind(info.path);
+    stmtRegisterValidPath.bind("sha256:" + printHash(info.hash));
+    stmtRegisterValidPath.bind(info.registrationTime);
+    if (info.deriver != "")
+        stmtRegisterValidPath.bind(info.deriver);
+    else
+        stmtRegisterValidPath.bind(); // null
+    if (info.narSize != 0)
+        stmtRegisterValidPath.bind64(info.narSize);
+    else
+        stmtRegisterValidPath.bind(); // null
+    if (sqlite3_step(stmtRegisterValidPath) != SQLITE_DONE)
+        throwSQLiteError(db, format("registering valid path `%1%' in database") % info.path);
+    unsigned long long id = sqlite3_last_insert_rowid(db);
+
+    /* If this is a derivation, then store the derivation outputs in
+       the database.  This is useful for the garbage collector: it can
+       efficiently query whether a path is an output of some
+       derivation. */
+    if (isDerivation(info.path)) addDerivationOutputs(id, info.path);
+
+    return id;
 }
 
 
-static Path referrersFileFor(const Path & path)
+void LocalStore::addDerivationOutputs(unsigned long long id, const Path & drvPath)
 {
-    string baseName = baseNameOf(path);
-    return (format("%1%/referrer/%2%") % nixDBPath % baseName).str();
+    Derivation drv = parseDerivation(readFile(drvPath));
+    foreach (DerivationOutputs::iterator, i, drv.outputs) {
+        SQLiteStmtUse use(stmtAddDerivationOutput);
+        stmtAddDerivationOutput.bind64(id);
+        stmtAddDerivationOutput.bind(i->first);
+        stmtAddDerivationOutput.bind(i->second.path);
+        if (sqlite3_step(stmtAddDerivationOutput) != SQLITE_DONE)
+            throwSQLiteError(db, format("adding derivation output for `%1%' in database") % drvPath);
+    }
 }
 
 
-static Path failedFileFor(const Path & path)
+PathSet LocalStore::queryValidDerivers(const Path & path)
 {
-    string baseName = baseNameOf(path);
-    return (format("%1%/failed/%2%") % nixDBPath % baseName).str();
-}
+    assertStorePath(path);
 
+    SQLiteStmtUse use(stmtQueryValidDerivers);
+    stmtQueryValidDerivers.bind(path);
 
-static Path tmpFileForAtomicUpdate(const Path & path)
-{
-    return (format("%1%/.%2%.%3%") % dirOf(path) % getpid() % baseNameOf(path)).str();
+    PathSet derivers;
+    int r;
+    while ((r = sqlite3_step(stmtQueryValidDerivers)) == SQLITE_ROW)
+        derivers.insert((const char *) sqlite3_column_text(stmtQueryValidDerivers, 0));
+    
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting valid derivers of `%1%'") % path);
+
+    return derivers;
 }
 
 
-void LocalStore::appendReferrer(const Path & from, const Path & to, bool lock)
+PathSet LocalStore::queryDerivationOutputs(const Path & drvPath)
 {
-    Path referrersFile = referrersFileFor(from);
-    
-    PathLocks referrersLock;
-    if (lock) {
-        referrersLock.lockPaths(singleton<PathSet, Path>(referrersFile));
-        referrersLock.setDeletion(true);
-    }
+    SQLiteStmtUse use(stmtQueryDerivationOutputs);
+    stmtQueryDerivationOutputs.bind(drvPath);
 
-    AutoCloseFD fd = open(referrersFile.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
-    if (fd == -1) throw SysError(format("opening file `%1%'") % referrersFile);
+    PathSet outputs;
+    int r;
+    while ((r = sqlite3_step(stmtQueryDerivationOutputs)) == SQLITE_ROW)
+        outputs.insert((const char *) sqlite3_column_text(stmtQueryDerivationOutputs, 0));
     
-    string s = " " + to;
-    writeFull(fd, (const unsigned char *) s.c_str(), s.size());
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting outputs of `%1%'") % drvPath);
 
-    if (doFsync) fsync(fd);
+    return outputs;
 }
 
 
-/* Atomically update the referrers file.  If `purge' is true, the set
-   of referrers is set to `referrers'.  Otherwise, the current set of
-   referrers is purged of invalid paths. */
-void LocalStore::rewriteReferrers(const Path & path, bool purge, PathSet referrers)
+void LocalStore::markUsed(const Path & path)
 {
-    Path referrersFile = referrersFileFor(path);
-    
-    PathLocks referrersLock(singleton<PathSet, Path>(referrersFile));
-    referrersLock.setDeletion(true);
+    if (usedPaths.find(path) != usedPaths.end()) return;
+    usedPaths[path] = time(0);
+    if (usedPaths.size() >= 1024) flushUsedPaths();
+}
 
-    if (purge)
-        /* queryReferrers() purges invalid paths, so that's all we
-           need. */
-        queryReferrers(path, referrers);
 
-    Path tmpFile = tmpFileForAtomicUpdate(referrersFile);
-    
-    AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
-    if (fd == -1) throw SysError(format("opening file `%1%'") % referrersFile);
-    
-    string s;
-    foreach (PathSet::const_iterator, i, referrers) {
-        s += " "; s += *i;
+void LocalStore::flushUsedPaths()
+{
+    if (usedPaths.empty()) return;
+
+    /* Failing to record the usage times shouldn't be fatal (e.g.,
+       the database might be read-only). */
+    try {
+        SQLiteTxn txn(db);
+        foreach (UsedPaths::iterator, i, usedPaths) {
+            SQLiteStmtUse use(stmtMarkUsed);
+            stmtMarkUsed.bind(i->second);
+            stmtMarkUsed.bind(i->first);
+            stmtMarkUsed.bind(i->second);
+            if (sqlite3_step(stmtMarkUsed) != SQLITE_DONE)
+                throwSQLiteError(db, format("recording use of `%1%'") % i->first);
+        }
+        txn.commit();
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot record path usage: %1%") % e.msg());
     }
-    
-    writeFull(fd, (const unsigned char *) s.c_str(), s.size());
 
-    if (doFsync) fsync(fd);
-    
-    fd.close(); /* for Windows; can't rename open file */
+    usedPaths.clear();
+}
+
 
-    if (rename(tmpFile.c_str(), referrersFile.c_str()) == -1)
-        throw SysError(format("cannot rename `%1%' to `%2%'") % tmpFile % referrersFile);
+void LocalStore::queryLastUsed(std::map<Path, time_t> & lastUsed)
+{
+    SQLiteStmt stmt;
+    stmt.create(db, "select path, coalesce(lastUsed, registrationTime) from ValidPaths;");
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW)
+        lastUsed[(const char *) sqlite3_column_text(stmt, 0)] = sqlite3_column_int64(stmt, 1);
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying last use of paths");
 }
 
 
-void LocalStore::flushDelayedUpdates()
+void LocalStore::flushOptimisedPaths()
 {
-    foreach (PathSet::iterator, i, delayedUpdates) {
-        rewriteReferrers(*i, true, PathSet());
+    if (optimisedPaths.empty()) return;
+
+    SQLiteTxn txn(db);
+    foreach (PathSet::iterator, i, optimisedPaths) {
+        SQLiteStmtUse use(stmtMarkOptimised);
+        stmtMarkOptimised.bind(*i);
+        if (sqlite3_step(stmtMarkOptimised) != SQLITE_DONE)
+            throwSQLiteError(db, format("marking `%1%' as optimised") % *i);
     }
-    delayedUpdates.clear();
+    txn.commit();
+
+    optimisedPaths.clear();
 }
 
 
-void LocalStore::registerValidPath(const Path & path,
-    const Hash & hash, const PathSet & references,
-    const Path & deriver)
+PathSet LocalStore::queryOptimisedPaths()
 {
-    ValidPathInfo info;
-    info.path = path;
-    info.hash = hash;
-    info.references = references;
-    info.deriver = deriver;
-    registerValidPath(info);
+    SQLiteStmt stmt;
+    stmt.create(db, "select v.path from OptimisedPaths o join ValidPaths v on o.id = v.id;");
+    PathSet res;
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW)
+        res.insert((const char *) sqlite3_column_text(stmt, 0));
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying optimised paths");
+    return res;
 }
 
 
-void LocalStore::registerValidPath(const ValidPathInfo & info, bool ignoreValidity)
+unsigned long long LocalStore::queryStoreSize()
 {
-    Path infoFile = infoFileFor(info.path);
-
-    ValidPathInfo oldInfo;
-    if (pathExists(infoFile)) oldInfo = queryPathInfo(info.path);
+    SQLiteStmt stmt;
+    stmt.create(db, "select coalesce(sum(narSize), 0) from ValidPaths;");
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        throwSQLiteError(db, "querying the size of the store");
+    return sqlite3_column_int64(stmt, 0);
+}
 
-    /* Note that it's possible for infoFile to already exist. */
 
-    /* Acquire a lock on each referrer file.  This prevents those
-       paths from being invalidated.  (It would be a violation of the
-       store invariants if we registered info.path as valid while some
-       of its references are invalid.)  NB: there can be no deadlock
-       here since we're acquiring the locks in sorted order. */
-    PathSet lockNames;
-    foreach (PathSet::const_iterator, i, info.references)
-        if (*i != info.path) lockNames.insert(referrersFileFor(*i));
-    PathLocks referrerLocks(lockNames);
-    referrerLocks.setDeletion(true);
-        
-    string refs;
-    foreach (PathSet::const_iterator, i, info.references) {
-        if (!refs.empty()) refs += " ";
-        refs += *i;
+/* Recompute the outputs of all valid derivations from the derivation
+   files. */
+void LocalStore::rebuildDerivationOutputs()
+{
+    SQLiteTxn txn(db);
 
-        if (!ignoreValidity && *i != info.path && !isValidPath(*i))
-            throw Error(format("cannot register `%1%' as valid, because its reference `%2%' isn't valid")
-                % info.path % *i);
+    if (sqlite3_exec(db, "delete from DerivationOutputs;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "clearing derivation outputs");
 
-        /* Update the referrer mapping for *i.  This must be done
-           before the info file is written to maintain the invariant
-           that if `path' is a valid path, then all its references
-           have referrer mappings back to `path'.  A " " is prefixed
-           to separate it from the previous entry.  It's not suffixed
-           to deal with interrupted partial writes to this file. */
-        if (oldInfo.references.find(*i) == oldInfo.references.end())
-            appendReferrer(*i, info.path, false);
+    SQLiteStmt stmt;
+    stmt.create(db, "select id, path from ValidPaths where path like '%.drv';");
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        Path drvPath = (const char *) sqlite3_column_text(stmt, 1);
+        if (!isDerivation(drvPath)) continue;
+        try {
+            addDerivationOutputs(sqlite3_column_int64(stmt, 0), drvPath);
+        } catch (SQLiteError & e) {
+            throw;
+        } catch (Error & e) {
+            /* The derivation may have disappeared or be corrupt;
+               verifyStore() will deal with that. */
+            printMsg(lvlError, format("warning: %1%") % e.msg());
+        }
     }
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying valid derivations");
 
-    assert(info.hash.type == htSHA256);
+    txn.commit();
+}
 
-    string s = (format(
-        "Hash: sha256:%1%\n"
-        "References: %2%\n"
-        "Deriver: %3%\n"
-        "Registered-At: %4%\n")
-        % printHash(info.hash) % refs % info.deriver %
-        (oldInfo.registrationTime ? oldInfo.registrationTime : time(0))).str();
 
-    /* Atomically rewrite the info file. */
-    Path tmpFile = tmpFileForAtomicUpdate(infoFile);
-    writeFile(tmpFile, s, doFsync);
-    if (rename(tmpFile.c_str(), infoFile.c_str()) == -1)
-        throw SysError(format("cannot rename `%1%' to `%2%'") % tmpFile % infoFile);
+void LocalStore::addReference(unsigned long long referrer, unsigned long long reference)
+{
+    SQLiteStmtUse use(stmtAddReference);
+    stmtAddReference.bind64(referrer);
+    stmtAddReference.bind64(reference);
+    if (sqlite3_step(stmtAddReference) != SQLITE_DONE)
+        throwSQLiteError(db, "adding reference to database");
+}
+
 
-    pathInfoCache[info.path] = info;
+void LocalStore::registerValidPath(const ValidPathInfo & info)
+{
+    ValidPathInfos infos;
+    infos.push_back(info);
+    registerValidPaths(infos);
 }
 
 
 void LocalStore::registerFailedPath(const Path & path)
 {
-    /* Write an empty file in the .../failed directory to denote the
-       failure of the builder for `path'. */
-    writeFile(failedFileFor(path), "");
+    SQLiteStmtUse use(stmtRegisterFailedPath);
+    stmtRegisterFailedPath.bind(path);
+    stmtRegisterFailedPath.bind(time(0));
+    if (sqlite3_step(stmtRegisterFailedPath) != SQLITE_DONE)
+        throwSQLiteError(db, format("registering failed path `%1%'") % path);
 }
 
 
 bool LocalStore::hasPathFailed(const Path & path)
 {
-    return pathExists(failedFileFor(path));
+    SQLiteStmtUse use(stmtHasPathFailed);
+    stmtHasPathFailed.bind(path);
+    int res = sqlite3_step(stmtHasPathFailed);
+    if (res != SQLITE_DONE && res != SQLITE_ROW)
+        throwSQLiteError(db, "querying whether path failed");
+    return res == SQLITE_ROW;
 }
 
 
@@ -387,94 +832,159 @@ Hash parseHashField(const Path & path, const string & s)
 }
 
 
-ValidPathInfo LocalStore::queryPathInfo(const Path & path, bool ignoreErrors)
+ValidPathInfo LocalStore::queryPathInfo(const Path & path)
 {
-    ValidPathInfo res;
-    res.path = path;
+    ValidPathInfo info;
+    if (pathInfoCache.lookup(path, info)) return info;
+    
+    info.path = path;
 
     assertStorePath(path);
 
-    if (!isValidPath(path))
-        throw Error(format("path `%1%' is not valid") % path);
+    /* Get the path info. */
+    SQLiteStmtUse use1(stmtQueryPathInfo);
 
-    std::map<Path, ValidPathInfo>::iterator lookup = pathInfoCache.find(path);
-    if (lookup != pathInfoCache.end()) return lookup->second;
+    stmtQueryPathInfo.bind(path);
     
-    /* Read the info file. */
-    Path infoFile = infoFileFor(path);
-    if (!pathExists(infoFile))
-        throw Error(format("path `%1%' is not valid") % path);
-    string info = readFile(infoFile);
+    int r = sqlite3_step(stmtQueryPathInfo);
+    if (r == SQLITE_DONE) throw Error(format("path `%1%' is not valid") % path);
+    if (r != SQLITE_ROW) throwSQLiteError(db, "querying path in database");
 
-    /* Parse it. */
-    Strings lines = tokenizeString(info, "\n");
+    info.id = sqlite3_column_int64(stmtQueryPathInfo, 0);
 
-    foreach (Strings::iterator, i, lines) {
-        string::size_type p = i->find(':');
-        if (p == string::npos) {
-            if (!ignoreErrors)
-                throw Error(format("corrupt line in `%1%': %2%") % infoFile % *i);
-            continue; /* bad line */
-        }
-        string name(*i, 0, p);
-        string value(*i, p + 2);
-        if (name == "References") {
-            Strings refs = tokenizeString(value, " ");
-            res.references = PathSet(refs.begin(), refs.end());
-        } else if (name == "Deriver") {
-            res.deriver = value;
-        } else if (name == "Hash") {
-            try {
-                res.hash = parseHashField(path, value);
-            } catch (Error & e) {
-                if (!ignoreErrors) throw;
-                printMsg(lvlError, format("cannot parse hash field in `%1%': %2%") % infoFile % e.msg());
-            }
-        } else if (name == "Registered-At") {
-            int n = 0;
-            string2Int(value, n);
-            res.registrationTime = n;
-        }
+    const char * s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 1);
+    assert(s);
+    info.hash = parseHashField(path, s);
+    
+    info.registrationTime = sqlite3_column_int(stmtQueryPathInfo, 2);
+
+    s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
+    if (s) info.deriver = s;
+
+    /* Note that narSize = NULL yields 0. */
+    info.narSize = sqlite3_column_int64(stmtQueryPathInfo, 4);
+
+    /* Get the references. */
+    SQLiteStmtUse use2(stmtQueryReferences);
+
+    stmtQueryReferences.bind64(info.id);
+
+    while ((r = sqlite3_step(stmtQueryReferences)) == SQLITE_ROW) {
+        s = (const char *) sqlite3_column_text(stmtQueryReferences, 0);
+        assert(s);
+        info.references.insert(s);
     }
 
-    return pathInfoCache[path] = res;
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting references of `%1%'") % path);
+
+    pathInfoCache.insert(info);
+
+    return info;
+}
+
+
+/* Update path info in the database.  Currently only updates the
+   hash, the deriver and (if known) the NAR size. */
+void LocalStore::updatePathInfo(const ValidPathInfo & info)
+{
+    SQLiteStmtUse use(stmtUpdatePathInfo);
+    stmtUpdatePathInfo.bind("sha256:" + printHash(info.hash));
+    if (info.deriver != "")
+        stmtUpdatePathInfo.bind(info.deriver);
+    else
+        stmtUpdatePathInfo.bind(); // null
+    if (info.narSize != 0)
+        stmtUpdatePathInfo.bind64(info.narSize);
+    else
+        stmtUpdatePathInfo.bind(); // null
+    stmtUpdatePathInfo.bind(info.path);
+    if (sqlite3_step(stmtUpdatePathInfo) != SQLITE_DONE)
+        throwSQLiteError(db, format("updating info of path `%1%' in database") % info.path);
+}
+
+
+unsigned long long LocalStore::queryValidPathId(const Path & path)
+{
+    SQLiteStmtUse use(stmtQueryPathInfo);
+    stmtQueryPathInfo.bind(path);
+    int res = sqlite3_step(stmtQueryPathInfo);
+    if (res == SQLITE_ROW) return sqlite3_column_int64(stmtQueryPathInfo, 0);
+    if (res == SQLITE_DONE) throw Error(format("path `%1%' is not valid") % path);
+    throwSQLiteError(db, "querying path in database");
 }
 
 
 bool LocalStore::isValidPath(const Path & path)
 {
-    /* Files in the info directory starting with a `.' are temporary
-       files. */
-    if (baseNameOf(path).at(0) == '.') return false;
+    /* Don't consult pathInfoCache here: the path may have been
+       garbage collected by another process since it was cached, and
+       callers rely on this to check validity after adding a temporary
+       root.  This query is answered from the unique index on
+       ValidPaths.path alone, without touching the table itself. */
+    SQLiteStmtUse use(stmtQueryValidPath);
+    stmtQueryValidPath.bind(path);
+    int res = sqlite3_step(stmtQueryValidPath);
+    if (res != SQLITE_DONE && res != SQLITE_ROW)
+        throwSQLiteError(db, "querying path in database");
+    return res == SQLITE_ROW;
+}
 
-    /* A path is valid if its info file exists and has a non-zero
-       size.  (The non-zero size restriction is to be robust to
-       certain kinds of filesystem corruption, particularly with
-       ext4.) */
-    Path infoFile = infoFileFor(path);
 
-    struct stat st;
-    if (lstat(infoFile.c_str(), &st)) {
-        if (errno == ENOENT) return false;
-        throw SysError(format("getting status of `%1%'") % infoFile);
+void LocalStore::enumerateValidPaths(PathCallback & callback)
+{
+    /* Use a private statement, so that the callback can call back
+       into the store.  The rows are produced one at a time, so this
+       runs in constant memory.  Note that since the statement is a
+       single read transaction, the callback sees a consistent
+       snapshot of the valid paths (in WAL mode, even if other
+       processes modify the database in the meantime). */
+    SQLiteStmt stmt;
+    stmt.create(db, "select path from ValidPaths");
+    
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char * s = (const char *) sqlite3_column_text(stmt, 0);
+        assert(s);
+        callback(s);
     }
 
-    if (st.st_size == 0) return false;
-    
-    return true;
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "error getting valid paths");
 }
 
 
-PathSet LocalStore::queryValidPaths()
+Paths LocalStore::queryValidPathsAfter(const Path & after, unsigned int max)
 {
-    PathSet paths;
-    Strings entries = readDirectory(nixDBPath + "/info");
-    foreach (Strings::iterator, i, entries)
-        if (i->at(0) != '.') paths.insert(nixStore + "/" + *i);
+    SQLiteStmtUse use(stmtQueryValidPathsAfter);
+
+    stmtQueryValidPathsAfter.bind(after);
+    stmtQueryValidPathsAfter.bind(max);
+
+    Paths paths;
+    int r;
+    while ((r = sqlite3_step(stmtQueryValidPathsAfter)) == SQLITE_ROW) {
+        const char * s = (const char *) sqlite3_column_text(stmtQueryValidPathsAfter, 0);
+        assert(s);
+        paths.push_back(s);
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "error getting valid paths");
+
     return paths;
 }
 
 
+PathSet LocalStore::queryValidPaths()
+{
+    PathSet res;
+    CollectPaths collect(res);
+    enumerateValidPaths(collect);
+    return res;
+}
+
+
 void LocalStore::queryReferences(const Path & path,
     PathSet & references)
 {
@@ -483,39 +993,23 @@ void LocalStore::queryReferences(const Path & path,
 }
 
 
-bool LocalStore::queryReferrersInternal(const Path & path, PathSet & referrers)
+void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 {
-    bool allValid = true;
-    
-    if (!isValidPath(path))
-        throw Error(format("path `%1%' is not valid") % path);
-
-    /* No locking is necessary here: updates are only done by
-       appending or by atomically replacing the file.  When appending,
-       there is a possibility that we see a partial entry, but it will
-       just be filtered out below (the partially written path will not
-       be valid, so it will be ignored). */
-
-    Path referrersFile = referrersFileFor(path);
-    if (!pathExists(referrersFile)) return true;
-    
-    AutoCloseFD fd = open(referrersFile.c_str(), O_RDONLY);
-    if (fd == -1) throw SysError(format("opening file `%1%'") % referrersFile);
-
-    Paths refs = tokenizeString(readFile(fd), " ");
+    assertStorePath(path);
 
-    foreach (Paths::iterator, i, refs)
-        /* Referrers can be invalid (see registerValidPath() for the
-           invariant), so we only return one if it is valid. */
-        if (isStorePath(*i) && isValidPath(*i)) referrers.insert(*i); else allValid = false;
+    SQLiteStmtUse use(stmtQueryReferrers);
 
-    return allValid;
-}
+    stmtQueryReferrers.bind(path);
 
-
-void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
-{
-    queryReferrersInternal(path, referrers);
+    int r;
+    while ((r = sqlite3_step(stmtQueryReferrers)) == SQLITE_ROW) {
+        const char * s = (const char *) sqlite3_column_text(stmtQueryReferrers, 0);
+        assert(s);
+        referrers.insert(s);
+    }
+    
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting references of `%1%'") % path);
 }
 
 
@@ -666,8 +1160,64 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
     foreach (ValidPathInfos::const_iterator, i, infos)
         dfsVisit(infosMap, i->path, visited, sorted);
 
+    /* Do everything in a single transaction, so that either all
+       paths become valid or none do. */
+    SQLiteTxn txn(db);
+    
+    std::map<Path, unsigned long long> ids;
+    PathSet reregistered;
+
+    foreach (Paths::iterator, i, sorted) {
+        ValidPathInfo & info(infosMap[*i]);
+        assert(info.hash.type == htSHA256);
+        if (isValidPath(info.path)) {
+            /* Re-registration keeps the original registration
+               time. */
+            ValidPathInfo old = queryPathInfo(info.path);
+            info.id = old.id;
+            info.registrationTime = old.registrationTime;
+            updatePathInfo(info);
+            reregistered.insert(info.path);
+        } else {
+            if (!info.registrationTime) info.registrationTime = time(0);
+            info.id = addValidPath(info);
+        }
+        ids[info.path] = info.id;
+    }
+
+    foreach (Paths::iterator, i, sorted) {
+        ValidPathInfo & info(infosMap[*i]);
+        foreach (PathSet::const_iterator, j, info.references) {
+            std::map<Path, unsigned long long>::iterator k = ids.find(*j);
+            unsigned long long ref;
+            if (k != ids.end())
+                ref = k->second;
+            else if (isValidPath(*j))
+                ref = queryValidPathId(*j);
+            else
+                throw Error(format("cannot register `%1%' as valid, because its reference `%2%' isn't valid")
+                    % info.path % *j);
+            addReference(info.id, ref);
+        }
+    }
+
+    txn.commit();
+
+    /* Only update the cache once the transaction has succeeded.  The
+       references of a re-registered path are now the union of the old
+       and new ones, so just drop it from the cache. */
     foreach (Paths::iterator, i, sorted)
-        registerValidPath(infosMap[*i]);
+        if (reregistered.find(*i) != reregistered.end())
+            pathInfoCache.erase(*i);
+        else
+            pathInfoCache.insert(infosMap[*i]);
+
+    if (queryBoolSetting("auto-optimise-store", false)) {
+        foreach (Paths::iterator, i, sorted)
+            if (reregistered.find(*i) == reregistered.end())
+                autoOptimisePath(*i);
+        flushOptimisedPaths();
+    }
 }
 
 
@@ -677,86 +1227,204 @@ void LocalStore::invalidatePath(const Path & path)
 {
     debug(format("invalidating path `%1%'") % path);
 
-    ValidPathInfo info;
+    SQLiteStmtUse use(stmtInvalidatePath);
+
+    stmtInvalidatePath.bind(path);
+
+    if (sqlite3_step(stmtInvalidatePath) != SQLITE_DONE)
+        throwSQLiteError(db, format("invalidating path `%1%' in database") % path);
+
+    /* Note that the foreign key constraints on the Refs table take
+       care of deleting the references entries for `path'. */
+
+    pathInfoCache.erase(path);
+}
+
+
+/* Return a fresh name for a temporary path in the store.  It's a
+   temporary root, so the garbage collector leaves it alone while it's
+   being created, but deletes it if we crash.  `name' is checked here,
+   since it may come from a client of the daemon, and the final store
+   path is only computed after the contents have been written. */
+Path LocalStore::makeTempPath(const string & name)
+{
+    checkStoreName(name);
+    static unsigned int counter = 0;
+    Path tmpPath = (format("%1%/.tmp-%2%-%3%-%4%")
+        % nixStore % getpid() % counter++ % name).str();
+    addTempRoot(tmpPath);
+    return tmpPath;
+}
 
-    if (pathExists(infoFileFor(path))) {
-        info = queryPathInfo(path);
 
-        /* Remove the info file. */
-        Path p = infoFileFor(path);
-        if (unlink(p.c_str()) == -1)
-            throw SysError(format("unlinking `%1%'") % p);
+/* Move `tmpPath' to `dstPath' and register it, or delete it if
+   `dstPath' is already valid.  `tmpPath' must already have canonical
+   metadata.  `narHash', if given, is the hash and size of the NAR
+   serialisation of `tmpPath'. */
+void LocalStore::moveToStore(const Path & tmpPath, const Path & dstPath,
+    const HashResult * narHash)
+{
+    addTempRoot(dstPath);
+
+    if (isValidPath(dstPath)) {
+        deletePathWrapped(tmpPath);
+        return;
+    }
+
+    /* The first check above is an optimisation to prevent
+       unnecessary lock acquisition. */
+
+    PathLocks outputLock(singleton<PathSet, Path>(dstPath));
+
+    if (isValidPath(dstPath))
+        deletePathWrapped(tmpPath);
+    
+    else {
+
+        if (pathExists(dstPath)) deletePathWrapped(dstPath);
+
+        if (rename(tmpPath.c_str(), dstPath.c_str()) == -1)
+            throw SysError(format("moving `%1%' to `%2%'") % tmpPath % dstPath);
+
+        ValidPathInfo info;
+        info.path = dstPath;
+        if (narHash) {
+            info.hash = narHash->first;
+            info.narSize = narHash->second;
+        } else {
+            HashResult hash = hashPath(htSHA256, dstPath);
+            info.hash = hash.first;
+            info.narSize = hash.second;
+        }
+        registerValidPath(info);
+    }
+
+    outputLock.setDeletion(true);
+}
+
+
+Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
+    bool recursive, HashType hashAlgo)
+{
+    if (recursive) {
+        StringSource source(dump);
+        return addToStoreFromDump(source, name, true, hashAlgo);
+    }
+
+    Path tmpPath = makeTempPath(name);
+    AutoDelete delTmp(tmpPath);
+    writeFile(tmpPath, dump);
+    canonicalisePathMetaData(tmpPath);
+
+    Path dstPath = makeFixedOutputPath(false, hashAlgo, hashString(hashAlgo, dump), name);
+    moveToStore(tmpPath, dstPath, 0);
+    delTmp.cancel();
+    
+    return dstPath;
+}
+
+
+/* Restores a NAR, and computes the hash of the contents of the regular
+   file at top level if `flat'.  In that case, the execute bit is
+   ignored.  Errors are remembered rather than thrown, so that the
+   caller can read the rest of the NAR (e.g., to stay in sync with the
+   client in the worker protocol). */
+struct AddToStoreSink : RestoreSink
+{
+    bool flat;
+    HashSink contentsHash;
+    string error;
+
+    AddToStoreSink(bool flat, HashType hashAlgo)
+        : flat(flat), contentsHash(hashAlgo)
+    {
+        canonicalise = true;
+    }
+
+    void fail(const string & msg)
+    {
+        if (error == "") error = msg;
+        fd.close();
+    }
+
+    void createDirectory(const Path & path)
+    {
+        if (flat) fail("regular file expected");
+        if (error != "") return;
+        try { RestoreSink::createDirectory(path); } catch (Error & e) { fail(e.msg()); }
+    }
+
+    void createRegularFile(const Path & path)
+    {
+        if (error != "") return;
+        try { RestoreSink::createRegularFile(path); } catch (Error & e) { fail(e.msg()); }
+    }
+
+    void isExecutable()
+    {
+        if (flat || error != "") return;
+        try { RestoreSink::isExecutable(); } catch (Error & e) { fail(e.msg()); }
+    }
+
+    void preallocateContents(unsigned long long size)
+    {
+        if (error != "") return;
+        try { RestoreSink::preallocateContents(size); } catch (Error & e) { fail(e.msg()); }
+    }
+
+    void receiveContents(unsigned char * data, unsigned int len)
+    {
+        if (flat) contentsHash(data, len);
+        if (error != "") return;
+        try { RestoreSink::receiveContents(data, len); } catch (Error & e) { fail(e.msg()); }
     }
 
-    /* Remove the referrers file for `path'. */
-    Path p = referrersFileFor(path);
-    if (pathExists(p) && unlink(p.c_str()) == -1)
-        throw SysError(format("unlinking `%1%'") % p);
+    void finalizeContents(unsigned long long size)
+    {
+        if (error != "") return;
+        try { RestoreSink::finalizeContents(size); } catch (Error & e) { fail(e.msg()); }
+    }
 
-    /* Clear `path' from the info cache. */
-    pathInfoCache.erase(path);
-    delayedUpdates.erase(path);
-
-    /* Cause the referrer files for each path referenced by this one
-       to be updated.  This has to happen after removing the info file
-       to preserve the invariant (see registerValidPath()).
-
-       The referrer files are updated lazily in flushDelayedUpdates()
-       to prevent quadratic performance in the garbage collector
-       (i.e., when N referrers to some path X are deleted, we have to
-       rewrite the referrers file for X N times, causing O(N^2) I/O).
-
-       What happens if we die before the referrer file can be updated?
-       That's not a problem, because stale (invalid) entries in the
-       referrer file are ignored by queryReferrers().  Thus a referrer
-       file is allowed to have stale entries; removing them is just an
-       optimisation.  verifyStore() gets rid of them eventually.
-    */
-    foreach (PathSet::iterator, i, info.references)
-        if (*i != path) delayedUpdates.insert(*i);
-}
+    void createSymlink(const Path & path, const string & target)
+    {
+        if (flat) fail("regular file expected");
+        if (error != "") return;
+        try { RestoreSink::createSymlink(path, target); } catch (Error & e) { fail(e.msg()); }
+    }
+};
 
 
-Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
+Path LocalStore::addToStoreFromDump(Source & dump, const string & name,
     bool recursive, HashType hashAlgo)
 {
-    Hash h = hashString(hashAlgo, dump);
-
-    Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, name);
-
-    addTempRoot(dstPath);
-
-    if (!isValidPath(dstPath)) {
-
-        /* The first check above is an optimisation to prevent
-           unnecessary lock acquisition. */
+    /* Restore the NAR to a temporary path in the store while hashing
+       it, so that we don't need to keep it in memory. */
+    Path tmpPath = makeTempPath(name);
+    AutoDelete delTmp(tmpPath);
 
-        PathLocks outputLock(singleton<PathSet, Path>(dstPath));
-
-        if (!isValidPath(dstPath)) {
-
-            if (pathExists(dstPath)) deletePathWrapped(dstPath);
+    AddToStoreSink sink(!recursive, hashAlgo);
+    sink.dstPath = tmpPath;
+    
+    HashSink narHash(htSHA256), algoHash(hashAlgo);
+    TeeSource narSource(dump, narHash);
+    TeeSource algoSource(narSource, algoHash);
+    bool needAlgoHash = recursive && hashAlgo != htSHA256;
 
-            if (recursive) {
-                StringSource source(dump);
-                restorePath(dstPath, source);
-            } else
-                writeFile(dstPath, dump);
+    parseDump(sink, needAlgoHash ? (Source &) algoSource : (Source &) narSource);
 
-            canonicalisePathMetaData(dstPath);
+    if (sink.error != "") throw Error(sink.error);
+    sink.finish();
 
-            /* Register the SHA-256 hash of the NAR serialisation of
-               the path in the database.  We may just have computed it
-               above (if called with recursive == true and hashAlgo ==
-               sha256); otherwise, compute it here. */
-            registerValidPath(dstPath,
-                (recursive && hashAlgo == htSHA256) ? h :
-                (recursive ? hashString(htSHA256, dump) : hashPath(htSHA256, dstPath)),
-                PathSet(), "");
-        }
+    HashResult nar = narHash.finish();
+    Hash h = !recursive ? sink.contentsHash.finish().first :
+        needAlgoHash ? algoHash.finish().first : nar.first;
+    
+    Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, name);
 
-        outputLock.setDeletion(true);
-    }
+    /* In the flat case, the NAR hash would include the execute bit,
+       which we ignored. */
+    moveToStore(tmpPath, dstPath, recursive ? &nar : 0);
+    delTmp.cancel();
 
     return dstPath;
 }
@@ -800,8 +1468,14 @@ Path LocalStore::addTextToStore(const string & name, const string & s,
 
             canonicalisePathMetaData(dstPath);
             
-            registerValidPath(dstPath,
-                hashPath(htSHA256, dstPath), references, "");
+            HashResult hash = hashPath(htSHA256, dstPath);
+            
+            ValidPathInfo info;
+            info.path = dstPath;
+            info.hash = hash.first;
+            info.narSize = hash.second;
+            info.references = references;
+            registerValidPath(info);
         }
 
         outputLock.setDeletion(true);
@@ -826,9 +1500,37 @@ struct HashAndWriteSink : Sink
         writeSink(data, len);
         if (hashing) hashSink(data, len);
     }
+    virtual void sendFile(int fd, unsigned long long len);
 };
 
 
+/* Hash the file straight from the page cache, then let the
+   destination sink copy it (possibly without it ever entering user
+   space).  Mapping the file is safe since store paths don't change
+   while we're reading them. */
+void HashAndWriteSink::sendFile(int fd, unsigned long long len)
+{
+    if (hashing && len > 0) {
+        void * p = len == (size_t) len
+            ? mmap(0, len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (p == MAP_FAILED)
+            hashSink.sendFile(fd, len);
+        else {
+            madvise(p, len, MADV_SEQUENTIAL);
+            const unsigned char * data = (const unsigned char *) p;
+            for (unsigned long long pos = 0; pos < len; ) {
+                checkInterrupt();
+                unsigned int n = len - pos > 1 << 24 ? 1 << 24 : len - pos;
+                hashSink(data + pos, n);
+                pos += n;
+            }
+            munmap(p, len);
+        }
+    }
+    writeSink.sendFile(fd, len);
+}
+
+
 #define EXPORT_MAGIC 0x4558494e
 
 
@@ -867,7 +1569,7 @@ void LocalStore::exportPath(const Path & path, bool sign,
     writeString(deriver, hashAndWriteSink);
 
     if (sign) {
-        Hash hash = hashAndWriteSink.hashSink.finish();
+        Hash hash = hashAndWriteSink.hashSink.finish().first;
         hashAndWriteSink.hashing = false;
 
         writeInt(1, hashAndWriteSink);
@@ -917,19 +1619,122 @@ struct HashAndReadSource : Source
 
 
 Path LocalStore::importPath(bool requireSignature, Source & source)
+{
+    ValidPathInfos infos;
+    std::list<PathLocks> outputLocks;
+    
+    Path path = importPath(requireSignature, source, infos, outputLocks);
+
+    registerImportedPaths(infos, outputLocks, true);
+
+    return path;
+}
+
+
+/* Maximum number of imported paths whose output locks are held
+   before they are registered.  Every lock is an open file
+   descriptor, so a large import must not keep all of them until the
+   end. */
+static const unsigned int importBatchSize = 256;
+
+
+/* Register the imported paths in `infos' and release their locks
+   (`outputLocks' runs parallel to `infos').  If `all' is false, paths
+   that refer to paths that haven't been imported yet are kept for a
+   later call. */
+void LocalStore::registerImportedPaths(ValidPathInfos & infos,
+    std::list<PathLocks> & outputLocks, bool all)
+{
+    PathSet ready;
+    foreach (ValidPathInfos::iterator, i, infos)
+        ready.insert(i->path);
+
+    if (!all) {
+        /* Drop paths that (indirectly) refer to paths that are
+           neither valid nor in this batch. */
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            foreach (ValidPathInfos::iterator, i, infos) {
+                if (ready.find(i->path) == ready.end()) continue;
+                foreach (PathSet::iterator, j, i->references)
+                    if (ready.find(*j) == ready.end() && !isValidPath(*j)) {
+                        ready.erase(i->path);
+                        changed = true;
+                        break;
+                    }
+            }
+        }
+    }
+
+    ValidPathInfos infos2;
+    foreach (ValidPathInfos::iterator, i, infos)
+        if (ready.find(i->path) != ready.end()) infos2.push_back(*i);
+
+    registerValidPaths(infos2);
+
+    ValidPathInfos::iterator i = infos.begin();
+    std::list<PathLocks>::iterator j = outputLocks.begin();
+    while (i != infos.end()) {
+        if (ready.find(i->path) != ready.end()) {
+            j->setDeletion(true);
+            infos.erase(i++);
+            outputLocks.erase(j++);
+        } else {
+            ++i; ++j;
+        }
+    }
+}
+
+
+Paths LocalStore::importPaths(bool requireSignature, Source & source)
+{
+    Paths res;
+    ValidPathInfos infos;
+    std::list<PathLocks> outputLocks;
+
+    /* The export may have been compressed (`nix-store --export
+       --bzip2'). */
+    DecompressionSource source2(source);
+    
+    while (true) {
+        unsigned long long n = readLongLong(source2);
+        if (n == 0) break;
+        if (n != 1) throw Error("input doesn't look like something created by `nix-store --export'");
+        res.push_back(importPath(requireSignature, source2, infos, outputLocks));
+        if (infos.size() >= importBatchSize)
+            registerImportedPaths(infos, outputLocks, false);
+    }
+
+    /* Register the imported paths in as few transactions as possible,
+       i.e., with few syncs of the database.  The output locks are held
+       until then.  If we fail before this point, the paths that have
+       already been moved into the store but not registered are simply
+       invalid, just as if we had crashed, and will be replaced by the
+       next import or removed by the garbage collector. */
+    registerImportedPaths(infos, outputLocks, true);
+
+    return res;
+}
+
+
+/* Unpack a single exported path into the store.  The path is not
+   registered as valid; instead, its info is appended to `infos', and
+   the lock on it is appended to `outputLocks'. */
+Path LocalStore::importPath(bool requireSignature, Source & source,
+    ValidPathInfos & infos, std::list<PathLocks> & outputLocks)
 {
     HashAndReadSource hashAndReadSource(source);
     
     /* We don't yet know what store path this archive contains (the
        store path follows the archive data proper), and besides, we
-       don't know yet whether the signature is valid. */
-    Path tmpDir = createTempDir(nixStore);
-    PathLocks tmpDirLock(singleton<PathSet, Path>(tmpDir));
-    tmpDirLock.setDeletion(true);
-    AutoDelete delTmp(tmpDir); /* !!! could be GC'ed! */
-    Path unpacked = tmpDir + "/unpacked";
+       don't know yet whether the signature is valid.  So unpack it
+       to a temporary path in the store.  It gets the metadata of a
+       store path right away, so it doesn't need another pass. */
+    Path unpacked = makeTempPath("import");
+    AutoDelete delUnpacked(unpacked);
 
-    restorePath(unpacked, hashAndReadSource);
+    restorePath(unpacked, hashAndReadSource, true);
 
     unsigned int magic = readInt(hashAndReadSource);
     if (magic != EXPORT_MAGIC)
@@ -942,7 +1747,7 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
     Path deriver = readString(hashAndReadSource);
     if (deriver != "") assertStorePath(deriver);
 
-    Hash hash = hashAndReadSource.hashSink.finish();
+    Hash hash = hashAndReadSource.hashSink.finish().first;
     hashAndReadSource.hashing = false;
 
     bool haveSignature = readInt(hashAndReadSource) == 1;
@@ -954,6 +1759,8 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
         string signature = readString(hashAndReadSource);
 
         if (requireSignature) {
+            Path tmpDir = createTempDir();
+            AutoDelete delTmp(tmpDir);
             Path sigFile = tmpDir + "/sig";
             writeFile(sigFile, signature);
 
@@ -983,9 +1790,15 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
     /* !!! way too much code duplication with addTextToStore() etc. */
     addTempRoot(dstPath);
 
+    /* Skip paths that are already valid or that already occur
+       earlier in this batch. */
+    foreach (ValidPathInfos::iterator, i, infos)
+        if (i->path == dstPath) return dstPath;
+
     if (!isValidPath(dstPath)) {
 
-        PathLocks outputLock;
+        outputLocks.push_back(PathLocks());
+        PathLocks & outputLock(outputLocks.back());
 
         /* Lock the output path.  But don't lock if we're being called
            from a build hook (whose parent process already acquired a
@@ -994,24 +1807,35 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
         if (find(locksHeld.begin(), locksHeld.end(), dstPath) == locksHeld.end())
             outputLock.lockPaths(singleton<PathSet, Path>(dstPath));
 
-        if (!isValidPath(dstPath)) {
+        /* Somebody else may have made it valid in the meantime. */
+        if (isValidPath(dstPath))
+            outputLocks.pop_back();
+
+        else {
 
             if (pathExists(dstPath)) deletePathWrapped(dstPath);
 
             if (rename(unpacked.c_str(), dstPath.c_str()) == -1)
                 throw SysError(format("cannot move `%1%' to `%2%'")
                     % unpacked % dstPath);
-
-            canonicalisePathMetaData(dstPath);
+            delUnpacked.cancel();
             
+            bool derivedInBatch = false;
+            foreach (ValidPathInfos::iterator, i, infos)
+                if (i->path == deriver) derivedInBatch = true;
+            if (deriver != "" && !derivedInBatch && !isValidPath(deriver)) deriver = "";
+
+            ValidPathInfo info;
+            info.path = dstPath;
             /* !!! if we were clever, we could prevent the hashPath()
                here. */
-            if (deriver != "" && !isValidPath(deriver)) deriver = "";
-            registerValidPath(dstPath,
-                hashPath(htSHA256, dstPath), references, deriver);
+            HashResult hash = hashPath(htSHA256, dstPath);
+            info.hash = hash.first;
+            info.narSize = hash.second;
+            info.references = references;
+            info.deriver = deriver;
+            infos.push_back(info);
         }
-        
-        outputLock.setDeletion(true);
     }
     
     return dstPath;
@@ -1025,84 +1849,94 @@ void LocalStore::deleteFromStore(const Path & path, unsigned long long & bytesFr
 
     assertStorePath(path);
 
+    invalidatePathChecked(path);
+
+    deletePathWrapped(path, bytesFreed, blocksFreed);
+}
+
+
+void LocalStore::invalidatePathChecked(const Path & path)
+{
     if (isValidPath(path)) {
-        /* Acquire a lock on the referrers file to prevent new
-           referrers to this path from appearing while we're deleting
-           it. */
-        PathLocks referrersLock(singleton<PathSet, Path>(referrersFileFor(path)));
-        referrersLock.setDeletion(true);
+        /* Do the referrers check and the invalidation in a single
+           transaction to prevent new referrers to this path from
+           appearing while we're deleting it. */
+        SQLiteTxn txn(db);
         PathSet referrers; queryReferrers(path, referrers);
         referrers.erase(path); /* ignore self-references */
         if (!referrers.empty())
             throw PathInUse(format("cannot delete path `%1%' because it is in use by `%2%'")
                 % path % showPaths(referrers));
         invalidatePath(path);
+        txn.commit();
     }
-
-    deletePathWrapped(path, bytesFreed, blocksFreed);
 }
 
 
-void LocalStore::verifyStore(bool checkContents)
+void LocalStore::verifyStore(bool checkContents, bool incremental)
 {
-    /* Check whether all valid paths actually exist. */
-    printMsg(lvlInfo, "checking path existence");
+    printMsg(lvlError, format("reading the Nix store..."));
 
-    PathSet validPaths2 = queryValidPaths(), validPaths;
+    /* Acquire the global GC lock to prevent a garbage collection. */
+    AutoCloseFD fdGCLock = openGCLock(ltWrite);
     
-    foreach (PathSet::iterator, i, validPaths2) {
-        checkInterrupt();
-        if (!isStorePath(*i)) {
-            printMsg(lvlError, format("path `%1%' is not in the Nix store") % *i);
-            invalidatePath(*i);
-        } else if (!pathExists(*i)) {
-            printMsg(lvlError, format("path `%1%' disappeared") % *i);
-            invalidatePath(*i);
-        } else {
-            Path infoFile = infoFileFor(*i);
-            struct stat st;
-            if (lstat(infoFile.c_str(), &st))
-                throw SysError(format("getting status of `%1%'") % infoFile);
-            if (st.st_size == 0) {
-                printMsg(lvlError, format("removing corrupt info file `%1%'") % infoFile);
-                if (unlink(infoFile.c_str()) == -1)
-                    throw SysError(format("unlinking `%1%'") % infoFile);
-            }
-            else validPaths.insert(*i);
+    Paths entries = readDirectory(nixStore);
+    PathSet store(entries.begin(), entries.end());
+
+    /* Check whether all valid paths actually exist. */
+    printMsg(lvlInfo, "checking path existence...");
+
+    PathSet validPaths, done;
+
+    struct VerifyPaths : PathCallback
+    {
+        LocalStore & localStore;
+        const PathSet & store;
+        PathSet & done, & validPaths;
+        VerifyPaths(LocalStore & localStore, const PathSet & store,
+            PathSet & done, PathSet & validPaths)
+            : localStore(localStore), store(store), done(done), validPaths(validPaths) { }
+        void operator () (const Path & path)
+        {
+            localStore.verifyPath(path, store, done, validPaths);
         }
+    };
+
+    VerifyPaths verifyPaths(*this, store, done, validPaths);
+    enumerateValidPaths(verifyPaths);
+
+    /* Release the GC lock so that checking content hashes (which can
+       take ages) doesn't block the GC or builds. */
+    fdGCLock.close();
+
+    /* In incremental mode, skip the paths whose contents have been
+       verified since they were last registered. */
+    PathSet verified;
+    if (checkContents && incremental) {
+        SQLiteStmt stmt;
+        stmt.create(db, "select path from ValidPaths where lastVerified >= registrationTime;");
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW)
+            verified.insert((const char *) sqlite3_column_text(stmt, 0));
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying verified paths");
     }
 
-
     /* Check the store path meta-information. */
-    printMsg(lvlInfo, "checking path meta-information");
+    printMsg(lvlInfo, "checking path meta-information...");
 
-    std::map<Path, PathSet> referrersCache;
-    
-    foreach (PathSet::iterator, i, validPaths) {
-        bool update = false;
-        ValidPathInfo info = queryPathInfo(*i, true);
+    ValidPathInfos toCheck;
 
-        /* Check the references: each reference should be valid, and
-           it should have a matching referrer. */
-        foreach (PathSet::iterator, j, info.references) {
-            if (validPaths.find(*j) == validPaths.end()) {
-                printMsg(lvlError, format("incomplete closure: `%1%' needs missing `%2%'")
-                    % *i % *j);
-                /* nothing we can do about it... */
-            } else {
-                if (referrersCache.find(*j) == referrersCache.end())
-                    queryReferrers(*j, referrersCache[*j]);
-                if (referrersCache[*j].find(*i) == referrersCache[*j].end()) {
-                    printMsg(lvlError, format("adding missing referrer mapping from `%1%' to `%2%'")
-                        % *j % *i);
-                    appendReferrer(*j, *i, true);
-                }
-            }
-        }
+    foreach (PathSet::iterator, i, validPaths) {
+        checkInterrupt();
+        
+        bool update = false, check = false;
+        ValidPathInfo info = queryPathInfo(*i);
 
         /* Check the deriver.  (Note that the deriver doesn't have to
            be a valid path.) */
         if (!info.deriver.empty() && !isStorePath(info.deriver)) {
+            printMsg(lvlError, format("removing invalid deriver of `%1%'") % *i);
             info.deriver = "";
             update = true;
         }
@@ -1110,78 +1944,407 @@ void LocalStore::verifyStore(bool checkContents)
         /* Check the content hash (optionally - slow). */
         if (info.hash.hashSize == 0) {
             printMsg(lvlError, format("re-hashing `%1%'") % *i);
-            info.hash = hashPath(htSHA256, *i);
+            HashResult current = hashPath(htSHA256, *i);
+            info.hash = current.first;
+            info.narSize = current.second;
             update = true;
-        } else if (checkContents) {
-            debug(format("checking contents of `%1%'") % *i);
-            Hash current = hashPath(info.hash.type, *i);
+        } else if (checkContents && verified.find(*i) == verified.end())
+            check = true;
+
+        /* Fill in the NAR size of paths registered before it was
+           recorded.  This only requires a stat() of every file.
+           Paths whose contents are checked get it from the hash. */
+        if (info.narSize == 0 && !check) {
+            printMsg(lvlTalkative, format("computing size of `%1%'") % *i);
+            info.narSize = computeNarSize(*i);
+            update = true;
+        }
+
+        if (update) {
+            updatePathInfo(info);
+            pathInfoCache.insert(info);
+        }
+
+        if (check) toCheck.push_back(info);
+    }
+
+    /* Rebuild the index of derivation outputs, in case it's out of
+       date (e.g. because a derivation was modified). */
+    printMsg(lvlInfo, "rebuilding the derivation output index...");
+    rebuildDerivationOutputs();
+
+    if (checkContents) verifyContents(toCheck);
+}
+
+
+/* Hashes paths on behalf of verifyContents().  Requests have the
+   form `<hash-type> <path>'; replies are `ok <hash> <nar-size>' or
+   `error <message>'. */
+struct HashPathHandler : WorkerHandler
+{
+    string operator () (const string & request)
+    {
+        string::size_type sp = request.find(' ');
+        if (sp == string::npos) throw Error("bad request");
+        HashType ht = parseHashType(string(request, 0, sp));
+        Path path(request, sp + 1);
+        try {
+            HashResult current = hashPath(ht, path);
+            return (format("ok %1% %2%") % printHash(current.first) % current.second).str();
+        } catch (Error & e) {
+            return "error " + e.msg();
+        }
+    }
+};
+
+
+/* Check the contents of the given paths against their hashes.  The
+   hashing is done by up to `build-max-jobs' worker processes.
+   Progress is recorded in a checkpoint file, so that an interrupted
+   run can be resumed: it holds the first path (in sorted order) that
+   hasn't been checked yet, or is being checked. */
+void LocalStore::verifyContents(const ValidPathInfos & infos)
+{
+    Path checkpointPath = nixDBPath + "/verify-checkpoint";
+
+    ValidPathInfos::const_iterator next = infos.begin();
+
+    if (pathExists(checkpointPath)) {
+        Path resumeFrom = readFile(checkpointPath);
+        printMsg(lvlError, format("resuming interrupted verification at `%1%'") % resumeFrom);
+        while (next != infos.end() && next->path < resumeFrom) ++next;
+    }
+
+    printMsg(lvlInfo, "checking path contents...");
+
+    HashPathHandler handler;
+    WorkerPool pool(handler, maxBuildJobs == 0 ? 1 : maxBuildJobs);
+    std::map<Path, ValidPathInfo> inFlight;
+    Paths done;
+
+    unsigned long long nrChecked = 0, bytesChecked = 0;
+    double startTime = getTime();
+    time_t lastCheckpoint = time(0);
+
+    while (next != infos.end() || pool.busy()) {
+
+        /* Hand out paths to idle workers. */
+        while (next != infos.end() && pool.haveIdleWorker()) {
+            const ValidPathInfo & info(*next++);
+            debug(format("checking contents of `%1%'") % info.path);
+            inFlight[info.path] = info;
+            pool.submit(printHashType(info.hash.type) + " " + info.path);
+        }
+
+        string request, reply;
+        pool.getReply(request, reply);
+
+        Path path(request, request.find(' ') + 1);
+        ValidPathInfo info = inFlight[path];
+        inFlight.erase(path);
+
+        Strings ss = tokenizeString(reply);
+
+        if (ss.size() == 3 && ss.front() == "ok") {
+            ss.pop_front();
+            Hash current = parseHash(info.hash.type, ss.front());
+            unsigned long long narSize;
+            if (!string2Int(ss.back(), narSize))
+                throw Error(format("bad reply `%1%' from worker process") % reply);
+            nrChecked++;
+            bytesChecked += narSize;
             if (current != info.hash) {
                 printMsg(lvlError, format("path `%1%' was modified! "
                         "expected hash `%2%', got `%3%'")
-                    % *i % printHash(info.hash) % printHash(current));
+                    % info.path % printHash(info.hash) % printHash(current));
+                /* Make sure incremental runs check it again. */
+                SQLiteStmtUse use(stmtMarkVerified);
+                stmtMarkVerified.bind(); // null
+                stmtMarkVerified.bind(info.path);
+                if (sqlite3_step(stmtMarkVerified) != SQLITE_DONE)
+                    throwSQLiteError(db, format("clearing verification time of `%1%'") % info.path);
+            } else {
+                if (info.narSize == 0) {
+                    info.narSize = narSize;
+                    updatePathInfo(info);
+                    pathInfoCache.insert(info);
+                }
+                done.push_back(info.path);
             }
         }
 
-        if (update) registerValidPath(info);
+        else if (string(reply, 0, 6) == "error ")
+            printMsg(lvlError, format("cannot check contents of `%1%': %2%")
+                % info.path % string(reply, 6));
+
+        else throw Error(format("bad reply `%1%' from worker process") % reply);
+
+        /* Periodically record which paths have been verified. */
+        if (time(0) - lastCheckpoint >= 30) {
+            markVerified(done);
+            done.clear();
+            Path resumeFrom = !inFlight.empty() ? inFlight.begin()->first
+                : next != infos.end() ? next->path : "";
+            writeFile(checkpointPath + ".tmp", resumeFrom);
+            if (rename((checkpointPath + ".tmp").c_str(), checkpointPath.c_str()) == -1)
+                throw SysError(format("renaming `%1%'") % checkpointPath);
+            lastCheckpoint = time(0);
+            double elapsed = getTime() - startTime;
+            printMsg(lvlInfo, format("checked %1% paths, %2$.1f MiB/s")
+                % nrChecked % (elapsed > 0 ? bytesChecked / elapsed / (1024 * 1024) : 0));
+        }
     }
 
-    referrersCache.clear();
-    
+    pool.shutdown();
+
+    markVerified(done);
+
+    if (pathExists(checkpointPath)) deletePath(checkpointPath);
+
+    double elapsed = getTime() - startTime;
+    printMsg(lvlInfo, format("checked %1% paths (%2$.2f MiB) in %3$.1f s, %4$.1f MiB/s")
+        % nrChecked % (bytesChecked / (1024.0 * 1024.0)) % elapsed
+        % (elapsed > 0 ? bytesChecked / elapsed / (1024 * 1024) : 0));
+}
+
+
+/* Record that the contents of `paths' have been verified now. */
+void LocalStore::markVerified(const Paths & paths)
+{
+    if (paths.empty()) return;
+    SQLiteTxn txn(db);
+    time_t now = time(0);
+    foreach (Paths::const_iterator, i, paths) {
+        SQLiteStmtUse use(stmtMarkVerified);
+        stmtMarkVerified.bind(now);
+        stmtMarkVerified.bind(*i);
+        if (sqlite3_step(stmtMarkVerified) != SQLITE_DONE)
+            throwSQLiteError(db, format("marking path `%1%' as verified") % *i);
+    }
+    txn.commit();
+}
 
-    /* Check the referrers. */
-    printMsg(lvlInfo, "checking referrers");
 
-    std::map<Path, PathSet> referencesCache;
+void LocalStore::verifyPath(const Path & path, const PathSet & store,
+    PathSet & done, PathSet & validPaths)
+{
+    checkInterrupt();
     
-    Strings entries = readDirectory(nixDBPath + "/referrer");
-    foreach (Strings::iterator, i, entries) {
-        Path from = nixStore + "/" + *i;
+    if (done.find(path) != done.end()) return;
+    done.insert(path);
+
+    if (!isStorePath(path)) {
+        printMsg(lvlError, format("path `%1%' is not in the Nix store") % path);
+        invalidatePath(path);
+        return;
+    }
+
+    if (store.find(baseNameOf(path)) == store.end()) {
+        /* Check any referrers first.  If we can invalidate them
+           first, then we can invalidate this path as well. */
+        bool canInvalidate = true;
+        PathSet referrers; queryReferrers(path, referrers);
+        foreach (PathSet::iterator, i, referrers)
+            if (*i != path) {
+                verifyPath(*i, store, done, validPaths);
+                if (validPaths.find(*i) != validPaths.end())
+                    canInvalidate = false;
+            }
+
+        if (canInvalidate) {
+            printMsg(lvlError, format("path `%1%' disappeared, removing from database...") % path);
+            invalidatePath(path);
+        } else
+            printMsg(lvlError, format("path `%1%' disappeared, but it still has valid referrers!") % path);
         
-        if (validPaths.find(from) == validPaths.end()) {
-            /* !!! This removes lock files as well.  Need to check
-               whether that's okay. */
-            printMsg(lvlError, format("removing referrers file for invalid `%1%'") % from);
-            Path p = referrersFileFor(from);
-            if (unlink(p.c_str()) == -1)
-                throw SysError(format("unlinking `%1%'") % p);
-            continue;
-        }
+        return;
+    }
+
+    validPaths.insert(path);
+}
 
-        PathSet referrers;
-        bool allValid = queryReferrersInternal(from, referrers);
-        bool update = false;
 
-        if (!allValid) {
-            printMsg(lvlError, format("removing some stale referrers for `%1%'") % from);
-            update = true;
-        }
+void LocalStore::checkpointDB()
+{
+    /* Merge the write-ahead log into the database.  If supported,
+       also truncate the log file, since it may have grown large
+       (e.g. after the garbage collector has invalidated many
+       paths).  This is a no-op if the database isn't in WAL mode. */
+#if SQLITE_VERSION_NUMBER >= 3008008
+    if (sqlite3_wal_checkpoint_v2(db, 0, SQLITE_CHECKPOINT_TRUNCATE, 0, 0) != SQLITE_OK)
+#else
+    if (sqlite3_wal_checkpoint(db, 0) != SQLITE_OK)
+#endif
+        throwSQLiteError(db, "checkpointing database");
+}
+
+
+void LocalStore::vacuumDB()
+{
+    printMsg(lvlInfo, "compacting the Nix database...");
+    checkpointDB();
+    if (sqlite3_exec(db, "vacuum;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "vacuuming database");
+    checkpointDB();
+}
+
+
+/* Functions for upgrading from the pre-SQLite database. */
+
+PathSet LocalStore::queryValidPathsOld()
+{
+    PathSet paths;
+    Strings entries = readDirectory(nixDBPath + "/info");
+    foreach (Strings::iterator, i, entries)
+        if (i->at(0) != '.') paths.insert(nixStore + "/" + *i);
+    return paths;
+}
+
+
+ValidPathInfo LocalStore::queryPathInfoOld(const Path & path)
+{
+    ValidPathInfo res;
+    res.path = path;
+
+    /* Read the info file. */
+    string baseName = baseNameOf(path);
+    Path infoFile = (format("%1%/info/%2%") % nixDBPath % baseName).str();
+    if (!pathExists(infoFile))
+        throw Error(format("path `%1%' is not valid") % path);
+    string info = readFile(infoFile);
 
-        /* Each referrer should have a matching reference. */
-        PathSet referrersNew;
-        foreach (PathSet::iterator, j, referrers) {
-            if (referencesCache.find(*j) == referencesCache.end())
-                queryReferences(*j, referencesCache[*j]);
-            if (referencesCache[*j].find(from) == referencesCache[*j].end()) {
-                printMsg(lvlError, format("removing unexpected referrer mapping from `%1%' to `%2%'")
-                    % from % *j);
-                update = true;
-            } else referrersNew.insert(*j);
+    /* Parse it. */
+    Strings lines = tokenizeString(info, "\n");
+
+    foreach (Strings::iterator, i, lines) {
+        string::size_type p = i->find(':');
+        if (p == string::npos)
+            throw Error(format("corrupt line in `%1%': %2%") % infoFile % *i);
+        string name(*i, 0, p);
+        string value(*i, p + 2);
+        if (name == "References") {
+            Strings refs = tokenizeString(value, " ");
+            res.references = PathSet(refs.begin(), refs.end());
+        } else if (name == "Deriver") {
+            res.deriver = value;
+        } else if (name == "Hash") {
+            res.hash = parseHashField(path, value);
+        } else if (name == "Registered-At") {
+            int n = 0;
+            string2Int(value, n);
+            res.registrationTime = n;
         }
+    }
+
+    return res;
+}
+
+
+/* Add a column to the ValidPaths table.  This uses a separate
+   connection, since the main one cannot prepare its statements until
+   the schema is up to date.  The schema version is only written once
+   all upgrades have been done, so an interrupted upgrade is redone;
+   hence, do nothing if the column already exists. */
+static void addValidPathsColumn(const string & column)
+{
+    SQLite db2;
+    if (sqlite3_open_v2((nixDBPath + "/db.sqlite").c_str(), &db2.db,
+            SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+        throw Error("cannot open SQLite database");
 
-        if (update) rewriteReferrers(from, false, referrersNew);
+    if (sqlite3_busy_timeout(db2, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(db2, "setting timeout");
+
+    {
+        SQLiteStmt stmt;
+        stmt.create(db2, "pragma table_info(ValidPaths);");
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char * name = (const char *) sqlite3_column_text(stmt, 1);
+            if (name && column == name) return;
+        }
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db2, "querying the columns of ValidPaths");
     }
+
+    printMsg(lvlError, "upgrading Nix store to new schema (this may take a while)...");
+
+    string s = "alter table ValidPaths add column " + column + " integer;";
+    if (sqlite3_exec(db2, s.c_str(), 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db2, format("adding column `%1%'") % column);
+}
+
+
+/* Upgrade from schema 6 to schema 7: record NAR sizes. */
+void LocalStore::upgradeStore7()
+{
+    addValidPathsColumn("narSize");
+}
+
+
+/* Upgrade from schema 7 to schema 8: record verification times. */
+void LocalStore::upgradeStore8()
+{
+    addValidPathsColumn("lastVerified");
+}
+
+
+/* Upgrade from schema 8 to schema 9: index the outputs of the valid
+   derivations.  The table itself has been created by openDB(). */
+void LocalStore::upgradeStore9()
+{
+    printMsg(lvlError, "indexing the outputs of derivations...");
+    rebuildDerivationOutputs();
+}
+
+
+/* Upgrade from schema 9 to schema 10: record when paths were last
+   used. */
+void LocalStore::upgradeStore10()
+{
+    addValidPathsColumn("lastUsed");
 }
 
 
-/* Upgrade from schema 4 (Nix 0.11) to schema 5 (Nix >= 0.12).  The
-   old schema uses Berkeley DB, the new one stores store path
-   meta-information in files. */
-void LocalStore::upgradeStore12()
+/* Upgrade from schema 5 (Nix 0.12-0.16) to schema 6 (Nix 1.0).  The
+   old schema stores path meta-information in files under info/ and
+   referrer/; the new one uses a SQLite database. */
+void LocalStore::upgradeStore6()
 {
-    throw Error(
-        "Your Nix store has a database in Berkeley DB format,\n"
-        "which is no longer supported. To convert to the new format,\n"
-        "please upgrade Nix to version 0.12 first.");
+    printMsg(lvlError, "upgrading Nix store to new schema (this may take a while)...");
+
+    openDB(true);
+
+    PathSet validPaths = queryValidPathsOld();
+
+    SQLiteTxn txn(db);
+    
+    std::map<Path, unsigned long long> pathToId;
+    
+    foreach (PathSet::iterator, i, validPaths) {
+        ValidPathInfo info = queryPathInfoOld(*i);
+        pathToId[*i] = addValidPath(info);
+        std::cerr << ".";
+    }
+
+    std::cerr << "|";
+    
+    foreach (PathSet::iterator, i, validPaths) {
+        ValidPathInfo info = queryPathInfoOld(*i);
+        unsigned long long referrer = pathToId[*i];
+        foreach (PathSet::iterator, j, info.references) {
+            std::map<Path, unsigned long long>::iterator k = pathToId.find(*j);
+            if (k == pathToId.end())
+                printMsg(lvlError, format("path `%1%' referenced by `%2%' is invalid, ignoring") % *j % *i);
+            else
+                addReference(referrer, k->second);
+        }
+        std::cerr << ".";
+    }
+
+    std::cerr << "\n";
+
+    txn.commit();
 }
 
 
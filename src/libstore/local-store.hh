@@ -2,9 +2,15 @@
 #define __LOCAL_STORE_H
 
 #include <string>
+#include <list>
 
 #include "store-api.hh"
 #include "util.hh"
+#include "pathlocks.hh"
+
+
+struct sqlite3;
+struct sqlite3_stmt;
 
 
 namespace nix {
@@ -12,8 +18,14 @@ namespace nix {
 
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
-   Version 4 is Nix 0.11.  Version 5 is Nix 0.12*/
-const int nixSchemaVersion = 5;
+   Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
+   Nix 1.0 with a SQLite database.  Version 7 adds the NAR size of
+   each valid path.  Version 8 adds the time at which the contents of
+   each valid path were last verified.  Version 9 adds an index of
+   the outputs of valid derivations.  Version 10 adds the time at
+   which each valid path was last used.  Version 11 records which
+   valid paths have been optimised. */
+const int nixSchemaVersion = 11;
 
 
 extern string drvsLogDir;
@@ -24,12 +36,16 @@ struct OptimiseStats
     unsigned long totalFiles;
     unsigned long sameContents;
     unsigned long filesLinked;
+    unsigned long pathsSkipped;
+    unsigned long filesHashed;
     unsigned long long bytesFreed;
     unsigned long long blocksFreed;
+    unsigned long long bytesScanned;
+    unsigned long long bytesHashed;
     OptimiseStats()
     {
-        totalFiles = sameContents = filesLinked = 0;
-        bytesFreed = blocksFreed = 0;
+        totalFiles = sameContents = filesLinked = pathsSkipped = filesHashed = 0;
+        bytesFreed = blocksFreed = bytesScanned = bytesHashed = 0;
     }
 };
 
@@ -41,6 +57,79 @@ struct RunningSubstituter
 };
 
 
+/* Wrapper object to close the SQLite database automatically. */
+struct SQLite
+{
+    sqlite3 * db;
+    SQLite() { db = 0; }
+    ~SQLite();
+    operator sqlite3 * () { return db; }
+};
+
+
+/* Wrapper object to create and destroy SQLite prepared statements. */
+struct SQLiteStmt
+{
+    sqlite3 * db;
+    sqlite3_stmt * stmt;
+    unsigned int curArg;
+    SQLiteStmt() { stmt = 0; }
+    void create(sqlite3 * db, const string & s);
+    void reset();
+    ~SQLiteStmt();
+    operator sqlite3_stmt * () { return stmt; }
+    void bind(const string & value);
+    void bind(int value);
+    void bind64(long long value);
+    void bind();
+};
+
+
+/* A cache of path info with a bounded (approximate) memory footprint.
+   When the budget is exceeded, the least recently used entries are
+   evicted. */
+class PathInfoCache
+{
+public:
+    PathInfoCache();
+
+    /* Set the memory budget in bytes; 0 disables caching. */
+    void setMaxBytes(unsigned long long maxBytes);
+
+    /* Return the cached info for `path' in `info', if any, and mark
+       it as recently used. */
+    bool lookup(const Path & path, ValidPathInfo & info);
+
+    void insert(const ValidPathInfo & info);
+
+    void erase(const Path & path);
+
+    /* Print the cache statistics (at lvlInfo if NIX_SHOW_STATS is
+       set). */
+    void printStats() const;
+
+private:
+    typedef std::list<Path> LRU;
+
+    struct Entry
+    {
+        ValidPathInfo info;
+        LRU::iterator lruPos;
+        unsigned long long bytes;
+    };
+
+    typedef std::map<Path, Entry> Entries;
+
+    Entries entries;
+    LRU lru; /* most recently used at the front */
+
+    unsigned long long maxBytes, curBytes, peakBytes;
+    unsigned long long hits, misses, evictions;
+
+    void evict();
+};
+
+
 class LocalStore : public StoreAPI
 {
 private:
@@ -63,7 +152,13 @@ public:
     bool isValidPath(const Path & path);
 
     PathSet queryValidPaths();
+
+    void enumerateValidPaths(PathCallback & callback);
+
+    Paths queryValidPathsAfter(const Path & after, unsigned int max);
     
+    ValidPathInfo queryPathInfo(const Path & path);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
@@ -71,6 +166,10 @@ public:
     void queryReferrers(const Path & path, PathSet & referrers);
 
     Path queryDeriver(const Path & path);
+
+    PathSet queryValidDerivers(const Path & path);
+
+    PathSet queryDerivationOutputs(const Path & drvPath);
     
     PathSet querySubstitutablePaths();
     
@@ -93,6 +192,13 @@ public:
     Path addToStoreFromDump(const string & dump, const string & name,
         bool recursive = true, HashType hashAlgo = htSHA256);
 
+    /* Like the above, but reads a NAR serialisation from `dump' (also
+       if recursive == false, in which case it must contain a single
+       regular file).  Its memory use doesn't depend on the size of
+       the NAR. */
+    Path addToStoreFromDump(Source & dump, const string & name,
+        bool recursive = true, HashType hashAlgo = htSHA256);
+
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references);
 
@@ -100,6 +206,8 @@ public:
         Sink & sink);
 
     Path importPath(bool requireSignature, Source & source);
+
+    Paths importPaths(bool requireSignature, Source & source);
     
     void buildDerivations(const PathSet & drvPaths);
 
@@ -120,21 +228,32 @@ public:
         unsigned long long & blocksFreed);
     
     /* Optimise the disk space usage of the Nix store by hard-linking
-       files with the same contents. */
+       files with the same contents.  Paths that have been optimised
+       before are skipped. */
     void optimiseStore(bool dryRun, OptimiseStats & stats);
 
-    /* Check the integrity of the Nix store. */
-    void verifyStore(bool checkContents);
+    /* Check the integrity of the Nix store.  If `checkContents' is
+       set, also check the contents of every path against its hash.
+       In `incremental' mode, paths whose contents have been verified
+       since they were registered are skipped. */
+    void verifyStore(bool checkContents, bool incremental);
+
+    /* Compact the Nix database: merge the write-ahead log into it and
+       rebuild it to reclaim the space of deleted rows. */
+    void vacuumDB();
 
     /* Register the validity of a path, i.e., that `path' exists, that
        the paths referenced by it exists, and in the case of an output
        path of a derivation, that it has been produced by a succesful
        execution of the derivation (or something equivalent).  Also
        register the hash of the file system contents of the path.  The
-       hash must be a SHA-256 hash. */
-    void registerValidPath(const Path & path,
-        const Hash & hash, const PathSet & references, const Path & deriver);
+       hash must be a SHA-256 hash.  If known, the size of the NAR
+       serialisation of the path should be recorded as well. */
+    void registerValidPath(const ValidPathInfo & info);
 
+    /* Register the validity of a set of paths in a single database
+       transaction, so that either all of them become valid or none
+       do. */
     void registerValidPaths(const ValidPathInfos & infos);
 
     /* Register that the build of a derivation with output `path' has
@@ -144,46 +263,138 @@ public:
     /* Query whether `path' previously failed to build. */
     bool hasPathFailed(const Path & path);
 
+    /* Record that `path' is being used, for least-recently-used
+       garbage collection.  This is cheap: the times are kept in
+       memory and written to the database in batches. */
+    void markUsed(const Path & path);
+
 private:
 
     Path schemaPath;
 
+    /* The directory containing a hard link to every file in the store
+       that has been optimised, named after its hash. */
+    Path linksDir;
+
     /* Lock file used for upgrading. */
     AutoCloseFD globalLock;
 
-    /* !!! The cache can grow very big.  Maybe it should be pruned
-       every once in a while. */
-    std::map<Path, ValidPathInfo> pathInfoCache;
+    /* Cache of path info; its size is bounded by the
+       `path-info-cache-size' option. */
+    PathInfoCache pathInfoCache;
+
+    /* The SQLite database object. */
+    SQLite db;
+
+    /* Some precompiled SQLite statements. */
+    SQLiteStmt stmtRegisterValidPath;
+    SQLiteStmt stmtUpdatePathInfo;
+    SQLiteStmt stmtAddReference;
+    SQLiteStmt stmtQueryPathInfo;
+    SQLiteStmt stmtQueryValidPath;
+    SQLiteStmt stmtQueryValidPathsAfter;
+    SQLiteStmt stmtQueryReferences;
+    SQLiteStmt stmtQueryReferrers;
+    SQLiteStmt stmtInvalidatePath;
+    SQLiteStmt stmtRegisterFailedPath;
+    SQLiteStmt stmtHasPathFailed;
+    SQLiteStmt stmtMarkVerified;
+    SQLiteStmt stmtAddDerivationOutput;
+    SQLiteStmt stmtQueryValidDerivers;
+    SQLiteStmt stmtQueryDerivationOutputs;
+    SQLiteStmt stmtMarkUsed;
+    SQLiteStmt stmtMarkOptimised;
+
+    /* Paths used by this process (and when), to be recorded in the
+       database by flushUsedPaths(). */
+    typedef std::map<Path, time_t> UsedPaths;
+    UsedPaths usedPaths;
+
+    /* Paths optimised by this process, to be recorded in the database
+       by flushOptimisedPaths(). */
+    PathSet optimisedPaths;
 
-    /* Store paths for which the referrers file must be purged. */
-    PathSet delayedUpdates;
+    int getSchema();
 
-    /* Whether to do an fsync() after writing Nix metadata. */
-    bool doFsync;
+    void openDB(bool create);
 
-    int getSchema();
+    unsigned long long queryValidPathId(const Path & path);
 
-    void registerValidPath(const ValidPathInfo & info, bool ignoreValidity = false);
+    unsigned long long addValidPath(const ValidPathInfo & info);
+        
+    void addReference(unsigned long long referrer, unsigned long long reference);
 
-    ValidPathInfo queryPathInfo(const Path & path, bool ignoreErrors = false);
+    void addDerivationOutputs(unsigned long long id, const Path & drvPath);
 
-    void appendReferrer(const Path & from, const Path & to, bool lock);
-    
-    void rewriteReferrers(const Path & path, bool purge, PathSet referrers);
+    void rebuildDerivationOutputs();
 
-    void flushDelayedUpdates();
-    
-    bool queryReferrersInternal(const Path & path, PathSet & referrers);
+    void flushUsedPaths();
+
+    /* Return the time at which each valid path was last used (or
+       registered, if it hasn't been used since). */
+    void queryLastUsed(std::map<Path, time_t> & lastUsed);
+
+    /* Return the sum of the known NAR sizes of all valid paths. */
+    unsigned long long queryStoreSize();
+
+    void flushOptimisedPaths();
+
+    /* Return the valid paths that have been optimised. */
+    PathSet queryOptimisedPaths();
+
+    /* Hard-link the files in a newly registered path to identical
+       files in the store, if `auto-optimise-store' is set. */
+    void autoOptimisePath(const Path & path);
     
+    void updatePathInfo(const ValidPathInfo & info);
+
+    Path makeTempPath(const string & name);
+
+    void moveToStore(const Path & tmpPath, const Path & dstPath,
+        const HashResult * narHash);
+
     void invalidatePath(const Path & path);
-    
-    void upgradeStore12();
+
+    /* Invalidate `path' prior to deleting it, unless it still has
+       referrers. */
+    void invalidatePathChecked(const Path & path);
+
+    void checkpointDB();
+
+    Path importPath(bool requireSignature, Source & source,
+        ValidPathInfos & infos, std::list<PathLocks> & outputLocks);
+
+    void registerImportedPaths(ValidPathInfos & infos,
+        std::list<PathLocks> & outputLocks, bool all);
+
+    int openGCLock(LockType lockType);
+
+    void verifyPath(const Path & path, const PathSet & store,
+        PathSet & done, PathSet & validPaths);
+
+    void verifyContents(const ValidPathInfos & infos);
+
+    void markVerified(const Paths & paths);
+
+    void upgradeStore6();
+    void upgradeStore7();
+    void upgradeStore8();
+    void upgradeStore9();
+    void upgradeStore10();
+    PathSet queryValidPathsOld();
+    ValidPathInfo queryPathInfoOld(const Path & path);
 
     struct GCState;
 
-    bool tryToDelete(GCState & state, const Path & path);
-    
-    PathSet findDerivers(GCState & state, const Path & path);
+    void findRoots(GCState & state);
+
+    void markLive(GCState & state);
+
+    bool limitsReached(GCState & state);
+
+    void removeUnusedLinks(GCState & state);
+
+    bool sweep(GCState & state, Paths & dead);
     
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
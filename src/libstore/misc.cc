@@ -1,6 +1,7 @@
 #include "misc.hh"
 #include "store-api.hh"
 #include "local-store.hh"
+#include "globals.hh"
 
 
 namespace nix {
@@ -38,6 +39,168 @@ void computeFSClosure(const Path & storePath,
 }
 
 
+/* The dominators are computed using the algorithm from Cooper,
+   Harvey and Kennedy, "A Simple, Fast Dominance Algorithm". */
+typedef vector<unsigned int> Nodes;
+
+static unsigned int intersectDominators(const Nodes & idom,
+    const Nodes & postorder, unsigned int a, unsigned int b)
+{
+    while (a != b) {
+        while (postorder[a] < postorder[b]) a = idom[a];
+        while (postorder[b] < postorder[a]) b = idom[b];
+    }
+    return a;
+}
+
+
+/* Add to `next' the paths that the garbage collector keeps alive
+   because of `path' besides its references, under the same settings
+   as LocalStore::markLive(). */
+static void addGCEdges(const Path & path,
+    bool keepOutputs, bool keepDerivations, PathSet & next)
+{
+    if (keepOutputs && isDerivation(path)) {
+        PathSet outputs = store->queryDerivationOutputs(path);
+        foreach (PathSet::iterator, i, outputs)
+            if (store->isValidPath(*i)) next.insert(*i);
+    }
+
+    if (keepDerivations) {
+        PathSet derivers = store->queryValidDerivers(path);
+        next.insert(derivers.begin(), derivers.end());
+    }
+}
+
+
+unsigned long long computeRootImpact(const Roots & roots,
+    std::map<Path, unsigned long long> & impact)
+{
+    bool keepOutputs = queryBoolSetting("gc-keep-outputs", false);
+    bool keepDerivations = queryBoolSetting("gc-keep-derivations", true);
+
+    /* Build the graph.  Node 0 is the virtual root.  Every root gets
+       a node of size 0 between the virtual root and the store path
+       it points to, so that a path pinned by several roots is not
+       attributed to any of them. */
+    vector<Nodes> succ(1);
+    vector<unsigned long long> size(1, 0);
+    std::map<Path, unsigned int> ids;
+    vector<Path> todo;
+    Nodes rootNodes;
+
+    foreach (Roots::const_iterator, i, roots) {
+        unsigned int root = succ.size();
+        succ.push_back(Nodes());
+        size.push_back(0);
+        succ[0].push_back(root);
+        rootNodes.push_back(root);
+
+        std::pair<std::map<Path, unsigned int>::iterator, bool> res =
+            ids.insert(std::pair<Path, unsigned int>(i->second, succ.size()));
+        if (res.second) {
+            succ.push_back(Nodes());
+            size.push_back(0);
+            todo.push_back(i->second);
+        }
+        succ[root].push_back(res.first->second);
+    }
+
+    while (!todo.empty()) {
+        checkInterrupt();
+        Path path = todo.back();
+        todo.pop_back();
+        unsigned int node = ids[path];
+
+        ValidPathInfo info = store->queryPathInfo(path);
+        size[node] = info.narSize;
+        if (size[node] == 0 && pathExists(path)) {
+            unsigned long long blocks;
+            computePathSize(path, size[node], blocks);
+        }
+
+        PathSet next(info.references);
+        addGCEdges(path, keepOutputs, keepDerivations, next);
+
+        foreach (PathSet::iterator, i, next) {
+            if (*i == path) continue;
+            std::pair<std::map<Path, unsigned int>::iterator, bool> res =
+                ids.insert(std::pair<Path, unsigned int>(*i, succ.size()));
+            if (res.second) {
+                succ.push_back(Nodes());
+                size.push_back(0);
+                todo.push_back(*i);
+            }
+            succ[node].push_back(res.first->second);
+        }
+    }
+
+    unsigned int nrNodes = succ.size();
+
+    /* Number the nodes in postorder, using an explicit stack since
+       reference chains can be long. */
+    Nodes postorder(nrNodes, 0), order;
+    vector<Nodes> pred(nrNodes);
+    vector<bool> visited(nrNodes, false);
+    vector<std::pair<unsigned int, unsigned int> > stack;
+    stack.push_back(std::pair<unsigned int, unsigned int>(0, 0));
+    visited[0] = true;
+    while (!stack.empty()) {
+        unsigned int node = stack.back().first;
+        unsigned int & next(stack.back().second);
+        if (next < succ[node].size()) {
+            unsigned int child = succ[node][next++];
+            pred[child].push_back(node);
+            if (!visited[child]) {
+                visited[child] = true;
+                stack.push_back(std::pair<unsigned int, unsigned int>(child, 0));
+            }
+        } else {
+            postorder[node] = order.size();
+            order.push_back(node);
+            stack.pop_back();
+        }
+    }
+
+    /* Iterate in reverse postorder until the dominators are stable.
+       The reference graph is acyclic (apart from self-references,
+       which we ignored), but the deriver and output edges create
+       cycles, so this may take a few passes. */
+    const unsigned int undefined = nrNodes;
+    Nodes idom(nrNodes, undefined);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (Nodes::reverse_iterator i = order.rbegin(); i != order.rend(); ++i) {
+            if (*i == 0) continue;
+            unsigned int newIdom = undefined;
+            foreach (Nodes::iterator, j, pred[*i]) {
+                if (idom[*j] == undefined) continue;
+                newIdom = newIdom == undefined ? *j
+                    : intersectDominators(idom, postorder, *j, newIdom);
+            }
+            if (idom[*i] != newIdom) {
+                idom[*i] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    /* A node's dominator comes after it in postorder, so summing in
+       postorder gives the size of every subtree. */
+    vector<unsigned long long> retained(size);
+    foreach (Nodes::iterator, i, order)
+        if (*i != 0) retained[idom[*i]] += retained[*i];
+
+    Nodes::iterator root = rootNodes.begin();
+    foreach (Roots::const_iterator, i, roots)
+        impact[i->first] = retained[*root++];
+
+    return retained[0];
+}
+
+
 Path findOutput(const Derivation & drv, string id)
 {
     foreach (DerivationOutputs::const_iterator, i, drv.outputs)
@@ -2,6 +2,7 @@
 #define __MISC_H
 
 #include "derivations.hh"
+#include "store-api.hh"
 
 
 namespace nix {
@@ -22,6 +23,20 @@ void computeFSClosure(const Path & storePath,
     PathSet & paths, bool flipDirection = false,
     bool includeOutputs = false);
 
+/* Compute, for each GC root (i.e., symlink) in `roots', the total
+   size of the store paths that are reachable only through that root,
+   i.e., that would become garbage if it were removed.  This is the
+   size of the subtree of the root in the dominator tree of the
+   reference graph, starting from a virtual node whose successors are
+   the roots.  Like the garbage collector, the graph also has edges
+   from derivations to their outputs if gc-keep-outputs is set, and
+   from outputs to their derivations if gc-keep-derivations is set.
+   Sizes are NAR sizes; paths whose NAR size is unknown are measured
+   on disk.  Returns the total size of the paths
+   reachable from the roots. */
+unsigned long long computeRootImpact(const Roots & roots,
+    std::map<Path, unsigned long long> & impact);
+
 /* Return the path corresponding to the output identifier `id' in the
    given derivation. */
 Path findOutput(const Derivation & drv, string id);
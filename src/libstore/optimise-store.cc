@@ -1,17 +1,217 @@
 #include "util.hh"
 #include "local-store.hh"
+#include "globals.hh"
+#include "worker-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 
 namespace nix {
 
 
-typedef std::map<Hash, std::pair<Path, ino_t> > HashToPath;
+/* The content index in `.links' has a hard link to one copy of every
+   distinct file in the store that has been optimised.  The name of
+   an entry says how much is known about its contents:
+
+   `<hash>': the base-32 SHA-256 hash of its NAR serialisation.
+
+   `<type>-<size>': no other entry has the same type (`r' for regular
+   files, `x' for executables and `l' for symlinks) and size, so its
+   contents haven't been read.
+
+   `<type>-<size>-<prefix>': no other entry has the same type, size
+   and hash of the first `prefixSize' bytes.
+
+   Thus a file is only hashed completely if there is another file
+   that could have the same contents.  When that happens to a file
+   whose entry isn't named after its hash yet, the entry is renamed.
+
+   The garbage collector deletes entries that are no longer used
+   without coordinating with us, so an entry that we have read may
+   disappear at any time.  It is then treated as absent. */
+static const unsigned long long prefixSize = 65536;
+
+
+/* The number of paths (or files) to process before recording them
+   in the database. */
+static const unsigned int maxBatchPaths = 1000;
+static const unsigned int maxBatchFiles = 100000;
+
+
+struct File
+{
+    Path path; /* where the contents can be read */
+    string name; /* the name of its index entry, if any */
+    struct stat st;
+    string prefix, hash; /* base-32, or empty if not computed */
+};
+
+typedef std::list<File> Files;
+
+typedef std::pair<char, unsigned long long> FileKey;
+
+
+static FileKey fileKey(const struct stat & st)
+{
+    char type = S_ISLNK(st.st_mode) ? 'l' : (st.st_mode & S_IXUSR) ? 'x' : 'r';
+    return FileKey(type, st.st_size);
+}
+
+
+/* Whether files with the given key are compared by the hash of their
+   first bytes before being hashed completely. */
+static bool usePrefix(const FileKey & key)
+{
+    return key.first != 'l' && key.second > prefixSize;
+}
+
+
+static string indexName(const File & file)
+{
+    if (file.hash != "") return file.hash;
+    FileKey key = fileKey(file.st);
+    string name = (format("%1%-%2%") % key.first % key.second).str();
+    if (file.prefix != "") name += "-" + file.prefix;
+    return name;
+}
+
+
+struct OptimiseState
+{
+    bool dryRun;
+    Path linksDir;
+    OptimiseStats & stats;
+
+    /* The entries of the content index, grouped by key.  Only
+       loaded by optimiseStore(). */
+    bool indexLoaded;
+    std::map<FileKey, Files> index;
+
+    /* The files of the paths in the current batch. */
+    Files files;
+
+    OptimiseState(bool dryRun, const Path & linksDir, OptimiseStats & stats)
+        : dryRun(dryRun), linksDir(linksDir), stats(stats), indexLoaded(false) { }
+};
+
+
+static Hash hashPrefix(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening file `%1%'") % path);
+    string data(prefixSize, 0);
+    size_t len = 0;
+    while (len < prefixSize) {
+        checkInterrupt();
+        ssize_t rd = read(fd, &data[len], prefixSize - len);
+        if (rd == -1) {
+            if (errno == EINTR) continue;
+            throw SysError(format("reading file `%1%'") % path);
+        }
+        if (rd == 0) break;
+        len += rd;
+    }
+    data.resize(len);
+    return hashString(htSHA256, data);
+}
+
+
+/* Hashing is done by a pool of `optimise-jobs' worker processes.
+   Requests are `<id> prefix <path>' or `<id> hash <path>', and the
+   reply is `ok <hash>' or `error <message>'. */
+struct HashHandler : WorkerHandler
+{
+    string operator () (const string & request)
+    {
+        string::size_type sp1 = request.find(' ');
+        string::size_type sp2 = request.find(' ', sp1 + 1);
+        string kind(request, sp1 + 1, sp2 - sp1 - 1);
+        Path path(request, sp2 + 1);
+        try {
+            Hash hash = kind == "prefix" ? hashPrefix(path) : hashPath(htSHA256, path).first;
+            return "ok " + printHash32(hash);
+        } catch (Error & e) {
+            return "error " + e.msg();
+        }
+    }
+};
+
+
+struct HashJob
+{
+    File * file;
+    bool prefix;
+    HashJob(File * file, bool prefix) : file(file), prefix(prefix) { }
+};
+
+typedef std::vector<HashJob> HashJobs;
+
+
+static void setHash(OptimiseState & state, HashJob & job, const string & reply)
+{
+    File & file(*job.file);
+    if (string(reply, 0, 3) != "ok ") {
+        /* An index entry may have been deleted by the garbage
+           collector.  Its hash then remains unknown. */
+        if (file.name != "" && !pathExists(file.path)) return;
+        throw Error(string(reply, 6));
+    }
+    if (job.prefix) {
+        file.prefix = string(reply, 3);
+        state.stats.bytesHashed += prefixSize;
+    } else {
+        file.hash = string(reply, 3);
+        state.stats.filesHashed++;
+        state.stats.bytesHashed += file.st.st_size;
+    }
+    printMsg(lvlDebug, format("`%1%' has %2% `%3%'")
+        % file.path % (job.prefix ? "prefix hash" : "hash") % string(reply, 3));
+}
+
+
+static void runHashJobs(OptimiseState & state, WorkerPool & pool, HashJobs & jobs)
+{
+    std::map<unsigned int, HashJob> running;
+    unsigned int nextId = 0;
+    HashJobs::iterator i = jobs.begin();
+
+    while (i != jobs.end() || pool.busy()) {
+
+        while (pool.haveIdleWorker() && i != jobs.end()) {
+            HashJob job = *i++;
+            unsigned int id = nextId++;
+            string request = (format("%1% %2% %3%")
+                % id % (job.prefix ? "prefix" : "hash") % job.file->path).str();
+            /* Requests are lines, so do weird file names ourselves. */
+            if (job.file->path.find('\n') != string::npos) {
+                HashHandler handler;
+                setHash(state, job, handler(request));
+                continue;
+            }
+            running.insert(std::pair<unsigned int, HashJob>(id, job));
+            pool.submit(request);
+        }
+
+        if (!pool.busy()) continue;
+        
+        string request, reply;
+        pool.getReply(request, reply);
+        unsigned int id;
+        if (!string2Int(string(request, 0, request.find(' ')), id)) abort();
+        std::map<unsigned int, HashJob>::iterator j = running.find(id);
+        assert(j != running.end());
+        setHash(state, j->second, reply);
+        running.erase(j);
+    }
+
+    jobs.clear();
+}
 
 
 static void makeWritable(const Path & path)
@@ -39,130 +239,404 @@ struct MakeReadOnly
 };
 
 
-static void hashAndLink(bool dryRun, HashToPath & hashToPath,
-    OptimiseStats & stats, const Path & path)
+/* Read the content index. */
+static void loadIndex(OptimiseState & state)
 {
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-	throw SysError(format("getting attributes of path `%1%'") % path);
+    if (state.indexLoaded) return;
+    state.indexLoaded = true;
+    if (!pathExists(state.linksDir)) return;
 
-    /* Sometimes SNAFUs can cause files in the Nix store to be
-       modified, in particular when running programs as root under
-       NixOS (example: $fontconfig/var/cache being modified).  Skip
-       those files. */
-    if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
-        printMsg(lvlError, format("skipping suspicious writable file `%1%'") % path);
-        return;
+    startNest(nest, lvlChatty, format("reading `%1%'") % state.linksDir);
+    
+    Strings names = readDirectory(state.linksDir);
+    foreach (Strings::iterator, i, names) {
+        checkInterrupt();
+        File entry;
+        entry.path = state.linksDir + "/" + *i;
+        entry.name = *i;
+        if (lstat(entry.path.c_str(), &entry.st) == -1) {
+            if (errno == ENOENT) continue;
+            throw SysError(format("getting attributes of path `%1%'") % entry.path);
+        }
+        string::size_type dash = i->find('-');
+        if (dash == string::npos)
+            entry.hash = *i;
+        else if ((dash = i->find('-', dash + 1)) != string::npos)
+            entry.prefix = string(*i, dash + 1);
+        state.index[fileKey(entry.st)].push_back(entry);
     }
+}
 
-    /* We can hard link regular files and symlinks. */
-    if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
 
-        /* Hash the file.  Note that hashPath() returns the hash over
-           the NAR serialisation, which includes the execute bit on
-           the file.  Thus, executable and non-executable files with
-           the same contents *won't* be linked (which is good because
-           otherwise the permissions would be screwed up).
-
-           Also note that if `path' is a symlink, then we're hashing
-           the contents of the symlink (i.e. the result of
-           readlink()), not the contents of the target (which may not
-           even exist). */
-        Hash hash = hashPath(htSHA256, path);
-        stats.totalFiles++;
-        printMsg(lvlDebug, format("`%1%' has hash `%2%'") % path % printHash(hash));
-
-        std::pair<Path, ino_t> prevPath = hashToPath[hash];
-        
-        if (prevPath.first == "") {
-            hashToPath[hash] = std::pair<Path, ino_t>(path, st.st_ino);
-            return;
+/* Rename the index entry of `entry' if more is known about it now.
+   Return false if the entry has disappeared. */
+static bool renameEntry(OptimiseState & state, File & entry)
+{
+    string name = indexName(entry);
+    if (name == entry.name) return true;
+    
+    if (!state.dryRun) {
+        Path newPath = state.linksDir + "/" + name;
+        /* Another process may have added an entry with these
+           contents in the meantime.  Then use that one. */
+        struct stat st;
+        if (lstat(newPath.c_str(), &st) == 0) {
+            if (unlink(entry.path.c_str()) == -1 && errno != ENOENT)
+                throw SysError(format("deleting `%1%'") % entry.path);
+            entry.st = st;
+        } else if (rename(entry.path.c_str(), newPath.c_str()) == -1) {
+            if (errno == ENOENT) return false;
+            throw SysError(format("renaming `%1%' to `%2%'") % entry.path % newPath);
         }
-            
-        /* Yes!  We've seen a file with the same contents.  Replace
-           the current file with a hard link to that file. */
-        stats.sameContents++;
-        if (prevPath.second == st.st_ino) {
-            printMsg(lvlDebug, format("`%1%' is already linked to `%2%'") % path % prevPath.first);
+        entry.path = newPath;
+    }
+    
+    printMsg(lvlDebug, format("renamed index entry `%1%' to `%2%'") % entry.name % name);
+    entry.name = name;
+    return true;
+}
+
+
+/* Make `file' the canonical copy of its contents. */
+static void addToIndex(OptimiseState & state, Files & entries, File file)
+{
+    file.name = indexName(file);
+    
+    if (!state.dryRun) {
+        Path linkPath = state.linksDir + "/" + file.name;
+        if (link(file.path.c_str(), linkPath.c_str()) == -1) {
+            /* E.g. EMLINK, or another process just added the same
+               entry.  Just leave this file alone. */
+            printMsg(lvlInfo, format("cannot link `%1%' to `%2%': %3%")
+                % linkPath % file.path % strerror(errno));
             return;
         }
+        file.path = linkPath;
+    }
+
+    entries.push_back(file);
+}
+
+
+/* Replace `file' with a hard link to `entry', which has the same
+   contents.  Return false if the entry has disappeared. */
+static bool replaceWithLink(OptimiseState & state, const File & file, const File & entry)
+{
+    OptimiseStats & stats(state.stats);
+    const Path & path(file.path);
+    
+    if (entry.st.st_ino == file.st.st_ino) {
+        stats.sameContents++;
+        printMsg(lvlDebug, format("`%1%' is already linked to `%2%'") % path % entry.path);
+        return true;
+    }
         
-        if (!dryRun) {
+    if (!state.dryRun) {
             
-            printMsg(lvlTalkative, format("linking `%1%' to `%2%'") % path % prevPath.first);
+        printMsg(lvlTalkative, format("linking `%1%' to `%2%'") % path % entry.path);
 
-            Path tempLink = (format("%1%.tmp-%2%-%3%")
-                % path % getpid() % rand()).str();
+        Path tempLink = (format("%1%.tmp-%2%-%3%")
+            % path % getpid() % rand()).str();
 
-            /* Make the containing directory writable, but only if
-               it's not the store itself (we don't want or need to
-               mess with  its permissions). */
-            bool mustToggle = !isStorePath(path);
-            if (mustToggle) makeWritable(dirOf(path));
+        /* Make the containing directory writable, but only if it's
+           not the store itself (we don't want or need to mess with
+           its permissions). */
+        bool mustToggle = !isStorePath(path);
+        if (mustToggle) makeWritable(dirOf(path));
             
-            /* When we're done, make the directory read-only again and
-               reset its timestamp back to 0. */
-            MakeReadOnly makeReadOnly(mustToggle ? dirOf(path) : "");
+        /* When we're done, make the directory read-only again and
+           reset its timestamp back to 0. */
+        MakeReadOnly makeReadOnly(mustToggle ? dirOf(path) : "");
         
-            if (link(prevPath.first.c_str(), tempLink.c_str()) == -1) {
-                if (errno == EMLINK) {
-                    /* Too many links to the same file (>= 32000 on
-                       most file systems).  This is likely to happen
-                       with empty files.  Just start over, creating
-                       links to the current file. */
-                    printMsg(lvlInfo, format("`%1%' has maximum number of links") % prevPath.first);
-                    hashToPath[hash] = std::pair<Path, ino_t>(path, st.st_ino);
-                    return;
-                }
-                throw SysError(format("cannot link `%1%' to `%2%'")
-                    % tempLink % prevPath.first);
+        if (link(entry.path.c_str(), tempLink.c_str()) == -1) {
+            if (errno == ENOENT) return false;
+            stats.sameContents++;
+            if (errno == EMLINK) {
+                /* Too many links to the same file (>= 32000 on most
+                   file systems).  This is likely to happen with
+                   empty files.  Just leave this file alone. */
+                printMsg(lvlInfo, format("`%1%' has maximum number of links") % entry.path);
+                return true;
             }
+            throw SysError(format("cannot link `%1%' to `%2%'")
+                % tempLink % entry.path);
+        }
+
+        stats.sameContents++;
 
-            /* Atomically replace the old file with the new hard link. */
-            if (rename(tempLink.c_str(), path.c_str()) == -1) {
-                if (errno == EMLINK) {
-                    /* Some filesystems generate too many links on the
-                       rename, rather than on the original link.
-                       (Probably it temporarily increases the st_nlink
-                       field before decreasing it again.) */
-                    printMsg(lvlInfo, format("`%1%' has maximum number of links") % prevPath.first);
-                    hashToPath[hash] = std::pair<Path, ino_t>(path, st.st_ino);
-
-                    /* Unlink the temp link. */
-                    if (unlink(tempLink.c_str()) == -1)
-                        printMsg(lvlError, format("unable to unlink `%1%'") % tempLink);
-                    return;
-                }
-                throw SysError(format("cannot rename `%1%' to `%2%'")
-                    % tempLink % path);
+        /* Atomically replace the old file with the new hard link. */
+        if (rename(tempLink.c_str(), path.c_str()) == -1) {
+            if (errno == EMLINK) {
+                /* Some filesystems generate too many links on the
+                   rename, rather than on the original link.
+                   (Probably it temporarily increases the st_nlink
+                   field before decreasing it again.) */
+                printMsg(lvlInfo, format("`%1%' has maximum number of links") % entry.path);
+
+                /* Unlink the temp link. */
+                if (unlink(tempLink.c_str()) == -1)
+                    printMsg(lvlError, format("unable to unlink `%1%'") % tempLink);
+                return true;
             }
-        } else
-            printMsg(lvlTalkative, format("would link `%1%' to `%2%'") % path % prevPath.first);
+            throw SysError(format("cannot rename `%1%' to `%2%'")
+                % tempLink % path);
+        }
+    } else {
+        stats.sameContents++;
+        printMsg(lvlTalkative, format("would link `%1%' to `%2%'") % path % entry.path);
+    }
         
-        stats.filesLinked++;
-        stats.bytesFreed += st.st_size;
-        stats.blocksFreed += st.st_blocks;
+    stats.filesLinked++;
+    stats.bytesFreed += file.st.st_size;
+    stats.blocksFreed += file.st.st_blocks;
+    return true;
+}
+
+
+/* Link `file', whose hash is known, to the entry with the same
+   contents, or add it to the index if there is none. */
+static void linkFile(OptimiseState & state, Files & entries, const File & file)
+{
+    foreach (Files::iterator, i, entries)
+        if (i->hash == file.hash) {
+            if (replaceWithLink(state, file, *i)) return;
+            /* The entry has disappeared, so `file' replaces it. */
+            entries.erase(i);
+            break;
+        }
+    addToIndex(state, entries, file);
+}
+
+
+/* Add the regular files and symlinks in `path' to the current
+   batch. */
+static void collectFiles(OptimiseState & state, const Path & path)
+{
+    checkInterrupt();
+    
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+	throw SysError(format("getting attributes of path `%1%'") % path);
+
+    /* Sometimes SNAFUs can cause files in the Nix store to be
+       modified, in particular when running programs as root under
+       NixOS (example: $fontconfig/var/cache being modified).  Skip
+       those files. */
+    if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
+        printMsg(lvlError, format("skipping suspicious writable file `%1%'") % path);
+        return;
+    }
+
+    /* We can hard link regular files and symlinks.  Note that files
+       are compared by their NAR serialisation, which includes the
+       execute bit on the file.  Thus, executable and non-executable
+       files with the same contents *won't* be linked (which is good
+       because otherwise the permissions would be screwed up).
+
+       Also note that if `path' is a symlink, then we're comparing the
+       contents of the symlink (i.e. the result of readlink()), not
+       the contents of the target (which may not even exist). */
+    if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+        File file;
+        file.path = path;
+        file.st = st;
+        state.files.push_back(file);
+        state.stats.totalFiles++;
+        state.stats.bytesScanned += st.st_size;
     }
 
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectory(path);
 	foreach (Strings::iterator, i, names)
-	    hashAndLink(dryRun, hashToPath, stats, path + "/" + *i);
+	    collectFiles(state, path + "/" + *i);
+    }
+}
+
+
+typedef std::map<FileKey, std::vector<File *> > FileGroups;
+
+
+/* Link the files in the current batch to the files in the index with
+   the same contents.  Files are grouped with the index entries of the
+   same type and size; only if a group has more than one member are
+   the hashes of their first bytes computed, and only files whose
+   prefix hashes are equal (or that are small) are hashed
+   completely. */
+static void processBatch(OptimiseState & state, WorkerPool & pool)
+{
+    if (state.files.empty()) return;
+    
+    loadIndex(state);
+
+    FileGroups groups;
+    foreach (Files::iterator, i, state.files) {
+        FileKey key = fileKey(i->st);
+        Files & entries(state.index[key]);
+        /* Skip files that are already linked to the index. */
+        bool linked = false;
+        foreach (Files::iterator, j, entries)
+            if (j->st.st_ino == i->st.st_ino) linked = true;
+        if (linked)
+            state.stats.sameContents++;
+        else
+            groups[key].push_back(&*i);
+    }
+
+    HashJobs jobs;
+    
+    foreach (FileGroups::iterator, i, groups) {
+        Files & entries(state.index[i->first]);
+        if (i->second.size() == 1 && entries.empty()) continue;
+        bool prefix = usePrefix(i->first);
+        foreach (std::vector<File *>::iterator, j, i->second)
+            if (prefix ? (*j)->prefix == "" : (*j)->hash == "")
+                jobs.push_back(HashJob(*j, prefix));
+        foreach (Files::iterator, j, entries)
+            if (prefix ? j->prefix == "" && j->hash == "" : j->hash == "")
+                jobs.push_back(HashJob(&*j, prefix));
+    }
+
+    /* Entries named after their full hash need their prefix hash
+       too, if they're in a group. */
+    foreach (FileGroups::iterator, i, groups) {
+        Files & entries(state.index[i->first]);
+        if (!usePrefix(i->first) || (i->second.size() == 1 && entries.empty())) continue;
+        foreach (Files::iterator, j, entries)
+            if (j->prefix == "" && j->hash != "")
+                jobs.push_back(HashJob(&*j, true));
     }
+
+    runHashJobs(state, pool, jobs);
+
+    foreach (FileGroups::iterator, i, groups) {
+        if (!usePrefix(i->first)) continue;
+        std::map<string, std::vector<File *> > byPrefix;
+        foreach (std::vector<File *>::iterator, j, i->second)
+            if ((*j)->prefix != "") byPrefix[(*j)->prefix].push_back(*j);
+        Files & entries(state.index[i->first]);
+        foreach (Files::iterator, j, entries)
+            if (j->prefix != "") byPrefix[j->prefix].push_back(&*j);
+        for (std::map<string, std::vector<File *> >::iterator j = byPrefix.begin();
+             j != byPrefix.end(); ++j)
+        {
+            if (j->second.size() == 1) continue;
+            foreach (std::vector<File *>::iterator, k, j->second)
+                if ((*k)->hash == "") jobs.push_back(HashJob(*k, false));
+        }
+    }
+
+    runHashJobs(state, pool, jobs);
+
+    /* Now do the actual linking. */
+    foreach (FileGroups::iterator, i, groups) {
+        Files & entries(state.index[i->first]);
+        for (Files::iterator j = entries.begin(); j != entries.end(); )
+            if (renameEntry(state, *j)) ++j; else j = entries.erase(j);
+        foreach (std::vector<File *>::iterator, j, i->second)
+            if ((*j)->hash != "")
+                linkFile(state, entries, **j);
+            else
+                addToIndex(state, entries, **j);
+    }
+
+    state.files.clear();
 }
 
 
 void LocalStore::optimiseStore(bool dryRun, OptimiseStats & stats)
 {
-    HashToPath hashToPath;
+    if (!dryRun) createDirs(linksDir);
+    OptimiseState state(dryRun, linksDir, stats);
 
+    unsigned int jobs = queryIntSetting("optimise-jobs", 1);
+    HashHandler handler;
+    WorkerPool pool(handler, jobs > 1 ? jobs : 0);
+
+    /* Paths are immutable, so a path that has been optimised before
+       only contains files that are already in the index. */
+    PathSet done = queryOptimisedPaths();
     PathSet paths = queryValidPaths();
+    Paths batch;
 
     foreach (PathSet::iterator, i, paths) {
+        if (done.find(*i) != done.end()) {
+            stats.pathsSkipped++;
+            continue;
+        }
         addTempRoot(*i);
         if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
-        startNest(nest, lvlChatty, format("hashing files in `%1%'") % *i);
-        hashAndLink(dryRun, hashToPath, stats, *i);
+        printMsg(lvlChatty, format("scanning files in `%1%'") % *i);
+        collectFiles(state, *i);
+        batch.push_back(*i);
+        
+        if (batch.size() >= maxBatchPaths || state.files.size() >= maxBatchFiles) {
+            processBatch(state, pool);
+            if (!dryRun) optimisedPaths.insert(batch.begin(), batch.end());
+            flushOptimisedPaths();
+            batch.clear();
+        }
+    }
+
+    processBatch(state, pool);
+    if (!dryRun) optimisedPaths.insert(batch.begin(), batch.end());
+    flushOptimisedPaths();
+}
+
+
+/* Look up the entry `name' in the index, and make sure that its hash
+   is known. */
+static void probeEntry(OptimiseState & state, Files & entries, const string & name)
+{
+    File entry;
+    entry.path = state.linksDir + "/" + name;
+    entry.name = name;
+    if (lstat(entry.path.c_str(), &entry.st) == -1) return;
+    if (name.find('-') == string::npos)
+        entry.hash = name;
+    else {
+        try {
+            entry.hash = printHash32(hashPath(htSHA256, entry.path).first);
+        } catch (SysError & e) {
+            if (e.errNo == ENOENT) return;
+            throw;
+        }
+        if (!renameEntry(state, entry)) return;
+    }
+    entries.push_back(entry);
+}
+
+
+/* Optimising a single path doesn't read the whole index.  Rather, the
+   new files are hashed, and the entries that could have the same
+   contents are looked up by name. */
+void LocalStore::autoOptimisePath(const Path & path)
+{
+    try {
+        createDirs(linksDir);
+        OptimiseStats stats;
+        OptimiseState state(false, linksDir, stats);
+        collectFiles(state, path);
+        
+        foreach (Files::iterator, i, state.files) {
+            FileKey key = fileKey(i->st);
+            Files entries;
+            File & file(*i);
+            file.hash = printHash32(hashPath(htSHA256, file.path).first);
+            probeEntry(state, entries, (format("%1%-%2%") % key.first % key.second).str());
+            if (usePrefix(key)) {
+                file.prefix = printHash32(hashPrefix(file.path));
+                probeEntry(state, entries, (format("%1%-%2%-%3%") % key.first % key.second % file.prefix).str());
+            }
+            probeEntry(state, entries, file.hash);
+            linkFile(state, entries, file);
+        }
+        
+        optimisedPaths.insert(path);
+        if (stats.filesLinked)
+            printMsg(lvlTalkative, format("freed %1% bytes by hard-linking %2% files in `%3%'")
+                % stats.bytesFreed % stats.filesLinked % path);
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot optimise `%1%': %2%") % path % e.msg());
     }
 }
 
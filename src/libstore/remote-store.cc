@@ -4,6 +4,8 @@
 #include "worker-protocol.hh"
 #include "archive.hh"
 #include "globals.hh"
+#include "derivations.hh"
+#include "compression.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -65,6 +67,7 @@ void RemoteStore::openConnection()
     /* Send the magic greeting, check for the reply. */
     try {
         writeInt(WORKER_MAGIC_1, to);
+        to.flush();
         unsigned int magic = readInt(from);
         if (magic != WORKER_MAGIC_2) throw Error("protocol mismatch");
 
@@ -216,10 +219,93 @@ bool RemoteStore::isValidPath(const Path & path)
 }
 
 
-PathSet RemoteStore::queryValidPaths()
+/* Receives newline-separated store paths streamed by the worker and
+   collects them. */
+struct PathLinesSink : Sink
+{
+    Paths & paths;
+    string pending;
+    PathLinesSink(Paths & paths) : paths(paths) { }
+    virtual void operator ()
+        (const unsigned char * data, unsigned int len)
+    {
+        pending.append((const char *) data, len);
+        string::size_type start = 0, end;
+        while ((end = pending.find('\n', start)) != string::npos) {
+            paths.push_back(string(pending, start, end - start));
+            start = end + 1;
+        }
+        pending.erase(0, start);
+    }
+};
+
+
+/* Number of paths fetched from the daemon at a time when enumerating
+   the valid paths. */
+static const unsigned int enumerateBatchSize = 4096;
+
+
+void RemoteStore::enumerateValidPaths(PathCallback & callback)
 {
     openConnection();
-    throw Error("not implemented");
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 8)
+        throw Error("the Nix daemon does not support enumerating valid paths");
+
+    /* Fetch the paths in bounded batches, calling `callback' between
+       operations, when it may call back into the store.  Unlike with
+       a local store, the callback doesn't see a consistent snapshot:
+       paths registered or deleted in the meantime may or may not be
+       reported. */
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 13) {
+        Path after;
+        while (true) {
+            Paths paths = queryValidPathsAfter(after, enumerateBatchSize);
+            if (paths.empty()) break;
+            after = paths.back();
+            while (!paths.empty()) {
+                callback(paths.front());
+                paths.pop_front();
+            }
+        }
+        return;
+    }
+
+    /* Older workers stream all paths in a single operation.  We can't
+       call `callback' while the operation is in progress, so keep
+       them in a list until it has finished.  This takes memory
+       proportional to the size of the store. */
+    writeInt(wopQueryValidPaths, to);
+    Paths paths;
+    PathLinesSink sink(paths);
+    processStderr(&sink);
+    if (!sink.pending.empty())
+        throw Error("unterminated path received from the Nix daemon");
+    while (!paths.empty()) {
+        callback(paths.front());
+        paths.pop_front();
+    }
+}
+
+
+Paths RemoteStore::queryValidPathsAfter(const Path & after, unsigned int max)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 13)
+        throw Error("the Nix daemon does not support enumerating valid paths in batches");
+    writeInt(wopQueryValidPathsAfter, to);
+    writeString(after, to);
+    writeInt(max, to);
+    processStderr();
+    return readStrings(from);
+}
+
+
+PathSet RemoteStore::queryValidPaths()
+{
+    PathSet res;
+    CollectPaths collect(res);
+    enumerateValidPaths(collect);
+    return res;
 }
 
 
@@ -252,6 +338,31 @@ bool RemoteStore::querySubstitutablePathInfo(const Path & path,
 }
 
 
+ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
+{
+    openConnection();
+    ValidPathInfo info;
+    info.path = path;
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 9) {
+        /* Older daemons don't know the NAR size. */
+        info.hash = queryPathHash(path);
+        queryReferences(path, info.references);
+        info.deriver = queryDeriver(path);
+        return info;
+    }
+    writeInt(wopQueryPathInfo, to);
+    writeString(path, to);
+    processStderr();
+    info.deriver = readString(from);
+    if (info.deriver != "") assertStorePath(info.deriver);
+    info.hash = parseHash(htSHA256, readString(from));
+    info.references = readStorePaths(from);
+    info.registrationTime = readInt(from);
+    info.narSize = readLongLong(from);
+    return info;
+}
+
+
 Hash RemoteStore::queryPathHash(const Path & path)
 {
     openConnection();
@@ -299,6 +410,43 @@ Path RemoteStore::queryDeriver(const Path & path)
 }
 
 
+PathSet RemoteStore::queryValidDerivers(const Path & path)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 14) {
+        /* Older daemons only know the registered deriver. */
+        PathSet res;
+        Path deriver = queryDeriver(path);
+        if (deriver != "" && isValidPath(deriver)) res.insert(deriver);
+        return res;
+    }
+    writeInt(wopQueryValidDerivers, to);
+    writeString(path, to);
+    processStderr();
+    return readStorePaths(from);
+}
+
+
+PathSet RemoteStore::queryDerivationOutputs(const Path & drvPath)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 14) {
+        /* Older daemons don't record derivation outputs, so read
+           them from the derivation itself. */
+        PathSet res;
+        if (!isValidPath(drvPath)) return res;
+        Derivation drv = parseDerivation(readFile(drvPath));
+        foreach (DerivationOutputs::iterator, i, drv.outputs)
+            res.insert(i->second.path);
+        return res;
+    }
+    writeInt(wopQueryDerivationOutputs, to);
+    writeString(drvPath, to);
+    processStderr();
+    return readStorePaths(from);
+}
+
+
 Path RemoteStore::addToStore(const Path & _srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter)
 {
@@ -355,6 +503,33 @@ Path RemoteStore::importPath(bool requireSignature, Source & source)
 }
 
 
+Paths RemoteStore::importPaths(bool requireSignature, Source & source)
+{
+    openConnection();
+
+    /* Decompress the export (`nix-store --export --bzip2') here, since
+       older daemons can't. */
+    DecompressionSource source2(source);
+
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 7) {
+        /* Older daemons can only import one path at a time. */
+        Paths res;
+        while (true) {
+            unsigned long long n = readLongLong(source2);
+            if (n == 0) break;
+            if (n != 1) throw Error("input doesn't look like something created by `nix-store --export'");
+            res.push_back(importPath(requireSignature, source2));
+        }
+        return res;
+    }
+    writeInt(wopImportPaths, to);
+    /* We ignore requireSignature, since the worker forces it to true
+       anyway. */    
+    processStderr(0, &source2);
+    return readStrings(from);
+}
+
+
 void RemoteStore::buildDerivations(const PathSet & drvPaths)
 {
     openConnection();
@@ -435,6 +610,14 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
         writeInt(0, to);
         writeInt(0, to);
     }
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 10) {
+        writeInt(options.sliceTime, to);
+        writeLongLong(options.sliceBytes, to);
+    }
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 11) {
+        writeLongLong(options.minFree, to);
+        writeLongLong(options.maxStoreSize, to);
+    }
     
     processStderr();
     
@@ -446,6 +629,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
 
 void RemoteStore::processStderr(Sink * sink, Source * source)
 {
+    to.flush();
     unsigned int msg;
     while ((msg = readInt(from)) == STDERR_NEXT
         || msg == STDERR_READ || msg == STDERR_WRITE) {
@@ -459,8 +643,14 @@ void RemoteStore::processStderr(Sink * sink, Source * source)
             unsigned int len = readInt(from);
             unsigned char * buf = new unsigned char[len];
             AutoDeleteArray<unsigned char> d(buf);
-            (*source)(buf, len);
+            /* Since protocol version 1.12, the worker accepts less
+               data than it asked for. */
+            if (GET_PROTOCOL_MINOR(daemonVersion) >= 12)
+                len = source->read(buf, len);
+            else
+                (*source)(buf, len);
             writeString(string((const char *) buf, len), to);
+            to.flush();
         }
         else {
             string s = readString(from);
@@ -28,7 +28,13 @@ public:
     bool isValidPath(const Path & path);
 
     PathSet queryValidPaths();
+
+    void enumerateValidPaths(PathCallback & callback);
+
+    Paths queryValidPathsAfter(const Path & after, unsigned int max);
     
+    ValidPathInfo queryPathInfo(const Path & path);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
@@ -36,6 +42,10 @@ public:
     void queryReferrers(const Path & path, PathSet & referrers);
 
     Path queryDeriver(const Path & path);
+
+    PathSet queryValidDerivers(const Path & path);
+
+    PathSet queryDerivationOutputs(const Path & drvPath);
     
     bool hasSubstitutes(const Path & path);
     
@@ -53,6 +63,8 @@ public:
         Sink & sink);
 
     Path importPath(bool requireSignature, Source & source);
+
+    Paths importPaths(bool requireSignature, Source & source);
     
     void buildDerivations(const PathSet & drvPaths);
 
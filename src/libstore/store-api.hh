@@ -57,6 +57,22 @@ struct GCOptions
        has dropped below `maxLinks'. */
     unsigned int maxLinks;
 
+    /* If either of these is non-zero, delete garbage incrementally:
+       release the global GC lock (so that builds can proceed) after
+       every `sliceTime' seconds or every `sliceBytes' bytes freed,
+       then reacquire it and rescan the roots.  Paths that have
+       become reachable in the meantime are not deleted. */
+    unsigned int sliceTime;
+    unsigned long long sliceBytes;
+
+    /* Stop once at least `minFree' bytes are available on the file
+       system containing the Nix store, or once the total size of
+       the valid paths has dropped to `maxStoreSize' bytes.  0 means
+       no limit.  Garbage is deleted in least-recently-used order, so
+       these can be used to evict cold paths while keeping hot ones. */
+    unsigned long long minFree;
+    unsigned long long maxStoreSize;
+
     GCOptions();
 };
 
@@ -90,6 +106,42 @@ struct SubstitutablePathInfo
 };
 
 
+struct ValidPathInfo 
+{
+    Path path;
+    Path deriver;
+    Hash hash;
+    PathSet references;
+    time_t registrationTime;
+    unsigned long long narSize; // 0 = unknown
+    unsigned long long id; // internal use only
+    ValidPathInfo() : registrationTime(0), narSize(0), id(0) { }
+};
+
+typedef list<ValidPathInfo> ValidPathInfos;
+
+
+/* Callback object for enumerating store paths (see
+   StoreAPI::enumerateValidPaths()). */
+struct PathCallback
+{
+    virtual ~PathCallback() { }
+    virtual void operator () (const Path & path) = 0;
+};
+
+
+/* A PathCallback that collects the paths in a set. */
+struct CollectPaths : PathCallback
+{
+    PathSet & paths;
+    CollectPaths(PathSet & paths) : paths(paths) { }
+    void operator () (const Path & path)
+    {
+        paths.insert(path);
+    }
+};
+
+
 class StoreAPI 
 {
 public:
@@ -102,6 +154,19 @@ public:
     /* Query the set of valid paths. */
     virtual PathSet queryValidPaths() = 0;
 
+    /* Call `callback' for each valid path, without building the set
+       of all valid paths in memory first.  The order is
+       unspecified. */
+    virtual void enumerateValidPaths(PathCallback & callback) = 0;
+
+    /* Return up to `max' valid paths that sort after `after' (all
+       paths if `after' is empty), in sorted order.  This allows the
+       valid paths to be enumerated in bounded batches. */
+    virtual Paths queryValidPathsAfter(const Path & after, unsigned int max) = 0;
+
+    /* Query information about a valid path. */
+    virtual ValidPathInfo queryPathInfo(const Path & path) = 0;
+
     /* Queries the hash of a valid path. */ 
     virtual Hash queryPathHash(const Path & path) = 0;
 
@@ -137,6 +202,13 @@ public:
        no deriver has been set. */
     virtual Path queryDeriver(const Path & path) = 0;
 
+    /* Return the valid derivations that have `path' as an output. */
+    virtual PathSet queryValidDerivers(const Path & path) = 0;
+
+    /* Return the outputs of the valid derivation `drvPath'.  The
+       outputs need not be valid themselves. */
+    virtual PathSet queryDerivationOutputs(const Path & drvPath) = 0;
+
     /* Query whether a path has substitutes. */
     virtual bool hasSubstitutes(const Path & path) = 0;
 
@@ -171,6 +243,15 @@ public:
        store. */
     virtual Path importPath(bool requireSignature, Source & source) = 0;
 
+    /* Import a sequence of NAR dumps created by exportPath(), each
+       preceded by a 1 and terminated by a 0 (the format produced by
+       `nix-store --export').  The imported paths are registered as
+       valid in batches of a few hundred paths, so if the import
+       fails, at most the paths of the current batch are lost; a
+       path is never registered before the paths it refers to.
+       Returns the imported paths in order. */
+    virtual Paths importPaths(bool requireSignature, Source & source) = 0;
+
     /* Ensure that the output paths of the derivation are valid.  If
        they are already valid, this is a no-op.  Otherwise, validity
        can be reached in two ways.  First, if the output paths is
@@ -324,18 +405,6 @@ string showPaths(const PathSet & paths);
 string makeValidityRegistration(const PathSet & paths,
     bool showDerivers, bool showHash);
     
-struct ValidPathInfo 
-{
-    Path path;
-    Path deriver;
-    Hash hash;
-    PathSet references;
-    time_t registrationTime;
-    ValidPathInfo() : registrationTime(0) { }
-};
-
-typedef list<ValidPathInfo> ValidPathInfos;
-
 ValidPathInfo decodeValidPathInfo(std::istream & str,
     bool hashGiven = false);
 
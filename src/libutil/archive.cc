@@ -10,6 +10,8 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <utime.h>
+#include <time.h>
 
 #include "archive.hh"
 #include "util.hh"
@@ -24,84 +26,172 @@ static string archiveVersion1 = "nix-archive-1";
 PathFilter defaultPathFilter;
 
 
-static void dump(const string & path, Sink & sink, PathFilter & filter);
+/* How many files in a directory are opened ahead of the one being
+   serialised, and how much of each the kernel is asked to start
+   reading.  This hides the latency of reading many small files from a
+   cold cache: the reads are in flight while we're still busy with the
+   previous files. */
+static const unsigned int readAheadFiles = 32;
+static const off_t readAheadBytes = 256 * 1024;
 
 
-static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter)
+/* Sink that records the members of a NAR as it's being written. */
+struct NarIndexer : Sink
 {
-    Strings names = readDirectory(path);
-    vector<string> names2(names.begin(), names.end());
-    sort(names2.begin(), names2.end());
+    Sink & sink;
+    NarIndex & index;
+    Path root;
+    unsigned long long pos;
+
+    NarIndexer(Sink & sink, NarIndex & index, const Path & root)
+        : sink(sink), index(index), root(root), pos(0) { }
+
+    void operator () (const unsigned char * data, unsigned int len)
+    {
+        sink(data, len);
+        pos += len;
+    }
 
-    for (vector<string>::iterator i = names2.begin();
-         i != names2.end(); ++i)
+    void sendFile(int fd, unsigned long long len)
     {
+        sink.sendFile(fd, len);
+        pos += len;
+    }
+
+    NarMember & add(const Path & path, NarMember::Type type)
+    {
+        NarMember member;
+        member.path = path == root ? "/" : string(path, root.size());
+        member.type = type;
+        index.push_back(member);
+        return index.back();
+    }
+};
+
+
+static void dump(const Path & path, const struct stat & st, int fd,
+    Sink & sink, PathFilter & filter, NarIndexer * indexer);
+
+
+static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter,
+    NarIndexer * indexer)
+{
+    Strings names = readDirectory(path);
+    vector<string> names2;
+    vector<struct stat> sts;
+
+    /* Determine the entries to dump and their types up front, so
+       that we know which files to read ahead. */
+    names.sort();
+    foreach (Strings::iterator, i, names) {
         Path entry = path + "/" + *i;
-        if (filter(entry)) {
-            writeString("entry", sink);
-            writeString("(", sink);
-            writeString("name", sink);
-            writeString(*i, sink);
-            writeString("node", sink);
-            dump(entry, sink, filter);
-            writeString(")", sink);
+        if (!filter(entry)) continue;
+        struct stat st;
+        if (lstat(entry.c_str(), &st))
+            throw SysError(format("getting attributes of path `%1%'") % entry);
+        names2.push_back(*i);
+        sts.push_back(st);
+    }
+
+    vector<AutoCloseFD> fds(names2.size());
+    size_t ahead = 0;
+
+    for (size_t n = 0; n < names2.size(); ++n) {
+
+        /* Don't read ahead past a subdirectory, so that no more than
+           `readAheadFiles' files are open at any time. */
+        while (ahead < names2.size() && ahead < n + readAheadFiles) {
+            const struct stat & st(sts[ahead]);
+            if (S_ISDIR(st.st_mode)) {
+                if (ahead == n) ahead++;
+                break;
+            }
+            if (S_ISREG(st.st_mode) && st.st_size > 0) {
+                /* If this fails, dumpContents() will report it. */
+                fds[ahead] = open((path + "/" + names2[ahead]).c_str(), O_RDONLY);
+#if HAVE_POSIX_FADVISE
+                if (fds[ahead] != -1)
+                    posix_fadvise(fds[ahead], 0,
+                        std::min(st.st_size, readAheadBytes), POSIX_FADV_WILLNEED);
+#endif
+            }
+            ahead++;
         }
+
+        writeString("entry", sink);
+        writeString("(", sink);
+        writeString("name", sink);
+        writeString(names2[n], sink);
+        writeString("node", sink);
+        dump(path + "/" + names2[n], sts[n], fds[n], sink, filter, indexer);
+        writeString(")", sink);
+
+        fds[n].close();
     }
 }
 
 
-static void dumpContents(const Path & path, size_t size, 
-    Sink & sink)
+static void dumpContents(const Path & path, size_t size, int fd,
+    Sink & sink, NarIndexer * indexer)
 {
     writeString("contents", sink);
     writeLongLong(size, sink);
 
-    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1) throw SysError(format("opening file `%1%'") % path);
-    
-    unsigned char buf[65536];
-    size_t left = size;
+    if (indexer) {
+        indexer->index.back().offset = indexer->pos;
+        indexer->index.back().size = size;
+    }
 
-    while (left > 0) {
-        size_t n = left > sizeof(buf) ? sizeof(buf) : left;
-        readFull(fd, buf, n);
-        left -= n;
-        sink(buf, n);
+    AutoCloseFD fd2;
+    if (fd == -1) {
+        fd2 = open(path.c_str(), O_RDONLY);
+        if (fd2 == -1) throw SysError(format("opening file `%1%'") % path);
+        fd = fd2;
     }
 
+    sink.sendFile(fd, size);
+
     writePadding(size, sink);
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+/* Dump `path', whose attributes are `st'.  If `fd' is not -1, it's
+   an open file descriptor for `path'. */
+static void dump(const Path & path, const struct stat & st, int fd,
+    Sink & sink, PathFilter & filter, NarIndexer * indexer)
 {
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-        throw SysError(format("getting attributes of path `%1%'") % path);
-
     writeString("(", sink);
 
     if (S_ISREG(st.st_mode)) {
         writeString("type", sink);
         writeString("regular", sink);
+        if (indexer) indexer->add(path, NarMember::tpRegular);
         if (st.st_mode & S_IXUSR) {
             writeString("executable", sink);
             writeString("", sink);
+            if (indexer) indexer->index.back().executable = true;
         }
-        dumpContents(path, (size_t) st.st_size, sink);
+        dumpContents(path, (size_t) st.st_size, fd, sink, indexer);
     } 
 
     else if (S_ISDIR(st.st_mode)) {
         writeString("type", sink);
         writeString("directory", sink);
-        dumpEntries(path, sink, filter);
+        if (indexer) indexer->add(path, NarMember::tpDirectory);
+        dumpEntries(path, sink, filter, indexer);
     }
 
     else if (S_ISLNK(st.st_mode)) {
         writeString("type", sink);
         writeString("symlink", sink);
         writeString("target", sink);
-        writeString(readLink(path), sink);
+        string target = readLink(path);
+        if (indexer) {
+            NarMember & member(indexer->add(path, NarMember::tpSymlink));
+            member.offset = indexer->pos + 8;
+            member.size = target.size();
+        }
+        writeString(target, sink);
     }
 
     else throw Error(format("file `%1%' has an unknown type") % path);
@@ -112,8 +202,74 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+
     writeString(archiveVersion1, sink);
-    dump(path, sink, filter);
+    dump(path, st, -1, sink, filter, 0);
+}
+
+
+void dumpPath(const Path & path, Sink & sink, NarIndex & index,
+    PathFilter & filter)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+
+    NarIndexer indexer(sink, index, path);
+    writeString(archiveVersion1, indexer);
+    dump(path, st, -1, indexer, filter, &indexer);
+}
+
+
+/* Size of the encoding of a string of length `len' (see encS in
+   archive.hh). */
+static unsigned long long encSize(unsigned long long len)
+{
+    return 8 + ((len + 7) & ~7ULL);
+}
+
+
+static unsigned long long narSize(const Path & path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+
+    unsigned long long n = encSize(1) + encSize(1); /* "(" ... ")" */
+    n += encSize(4); /* "type" */
+
+    if (S_ISREG(st.st_mode)) {
+        n += encSize(7); /* "regular" */
+        if (st.st_mode & S_IXUSR)
+            n += encSize(10) + encSize(0); /* "executable" "" */
+        n += encSize(8) + encSize(st.st_size); /* "contents" */
+    } 
+
+    else if (S_ISDIR(st.st_mode)) {
+        n += encSize(9); /* "directory" */
+        Strings names = readDirectory(path);
+        foreach (Strings::iterator, i, names)
+            /* "entry" "(" "name" name "node" ... ")" */
+            n += encSize(5) + encSize(1) + encSize(4) + encSize(i->size())
+                + encSize(4) + narSize(path + "/" + *i) + encSize(1);
+    }
+
+    else if (S_ISLNK(st.st_mode))
+        /* "symlink" "target" target */
+        n += encSize(7) + encSize(6) + encSize(readLink(path).size());
+
+    else throw Error(format("file `%1%' has an unknown type") % path);
+
+    return n;
+}
+
+
+unsigned long long computeNarSize(const Path & path)
+{
+    return encSize(archiveVersion1.size()) + narSize(path);
 }
 
 
@@ -269,74 +425,260 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
-struct RestoreSink : ParseSink
+/* Set the modification time of `path' to 1 second into the epoch,
+   like canonicalisePathMetaData() does. */
+static void setCanonicalTime(const Path & path)
 {
-    Path dstPath;
-    AutoCloseFD fd;
+    struct utimbuf utimbuf;
+    utimbuf.actime = time(0);
+    utimbuf.modtime = 1;
+    if (utime(path.c_str(), &utimbuf) == -1)
+        throw SysError(format("changing modification time of `%1%'") % path);
+}
 
-    void createDirectory(const Path & path)
+
+void RestoreSink::createDirectory(const Path & path)
+{
+    Path p = dstPath + path;
+    if (mkdir(p.c_str(), 0777) == -1)
+        throw SysError(format("creating directory `%1%'") % p);
+    if (canonicalise) dirs.push_back(p);
+}
+
+
+void RestoreSink::closeFile()
+{
+    if (fd == -1) return;
+    fd.close();
+    if (canonicalise) setCanonicalTime(curFile);
+}
+
+
+void RestoreSink::createRegularFile(const Path & path)
+{
+    closeFile();
+    curFile = dstPath + path;
+    fd = open(curFile.c_str(), O_CREAT | O_EXCL | O_WRONLY,
+        canonicalise ? 0444 : 0666);
+    if (fd == -1) throw SysError(format("creating file `%1%'") % curFile);
+
+    /* Normally the umask is 022, which doesn't affect read-only
+       files. */
+    if (canonicalise) {
+        if (!checkedUmask) {
+            mode_t mask = umask(0);
+            umask(mask);
+            umaskHidesRead = mask & 0444;
+            checkedUmask = true;
+        }
+        if (umaskHidesRead && fchmod(fd, 0444) == -1)
+            throw SysError(format("changing mode of `%1%'") % curFile);
+    }
+}
+
+
+void RestoreSink::isExecutable()
+{
+    if (canonicalise) {
+        if (fchmod(fd, 0555) == -1)
+            throw SysError(format("changing mode of `%1%'") % curFile);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError("fstat");
+    if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        throw SysError("fchmod");
+}
+
+
+void RestoreSink::preallocateContents(unsigned long long len)
+{
+#if HAVE_POSIX_FALLOCATE
+    if (len) {
+        errno = posix_fallocate(fd, 0, len);
+        /* Note that EINVAL may indicate that the underlying
+           filesystem doesn't support preallocation (e.g. on
+           OpenSolaris).  Since preallocation is just an
+           optimisation, ignore it. */
+        if (errno && errno != EINVAL)
+            throw SysError(format("preallocating file of %1% bytes") % len);
+    }
+#endif
+}
+
+
+void RestoreSink::receiveContents(unsigned char * data, unsigned int len)
+{
+    writeFull(fd, data, len);
+}
+
+
+void RestoreSink::finalizeContents(unsigned long long size)
+{
+    errno = ftruncate(fd, size);
+    if (errno) throw SysError(format("truncating file to its allocated length of %1% bytes") % size);
+}
+
+
+void RestoreSink::createSymlink(const Path & path, const string & target)
+{
+    Path p = dstPath + path;
+    if (symlink(target.c_str(), p.c_str()) == -1)
+        throw SysError(format("creating symlink `%1%'") % p);
+}
+
+
+void RestoreSink::finish()
+{
+    closeFile();
+
+    /* Do the subdirectories before their parents, since making a
+       directory read-only first would prevent the rest. */
+    for (Paths::reverse_iterator i = dirs.rbegin(); i != dirs.rend(); ++i) {
+        if (chmod(i->c_str(), 0555) == -1)
+            throw SysError(format("changing mode of `%1%'") % *i);
+        setCanonicalTime(*i);
+    }
+    dirs.clear();
+}
+
+ 
+void restorePath(const Path & path, Source & source, bool canonicalise)
+{
+    RestoreSink sink;
+    sink.dstPath = path;
+    sink.canonicalise = canonicalise;
+    parseDump(sink, source);
+    sink.finish();
+}
+
+
+/* Source that counts the bytes read from it. */
+struct CountingSource : Source
+{
+    Source & source;
+    unsigned long long pos;
+    CountingSource(Source & source) : source(source), pos(0) { }
+    void operator () (unsigned char * data, unsigned int len)
     {
-        Path p = dstPath + path;
-        if (mkdir(p.c_str(), 0777) == -1)
-            throw SysError(format("creating directory `%1%'") % p);
-    };
+        source(data, len);
+        pos += len;
+    }
+};
 
-    void createRegularFile(const Path & path)
+
+struct IndexSink : ParseSink
+{
+    CountingSource & source;
+    NarIndex & index;
+
+    IndexSink(CountingSource & source, NarIndex & index)
+        : source(source), index(index) { }
+
+    NarMember & add(const Path & path, NarMember::Type type)
     {
-        Path p = dstPath + path;
-        fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
-        if (fd == -1) throw SysError(format("creating file `%1%'") % p);
+        NarMember member;
+        member.path = path == "" ? "/" : path;
+        member.type = type;
+        index.push_back(member);
+        return index.back();
     }
 
-    void isExecutable()
+    void createDirectory(const Path & path)
     {
-        struct stat st;
-        if (fstat(fd, &st) == -1)
-            throw SysError("fstat");
-        if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-            throw SysError("fchmod");
+        add(path, NarMember::tpDirectory);
     }
 
-    void preallocateContents(unsigned long long len)
+    void createRegularFile(const Path & path)
     {
-#if HAVE_POSIX_FALLOCATE
-        if (len) {
-            errno = posix_fallocate(fd, 0, len);
-            /* Note that EINVAL may indicate that the underlying
-               filesystem doesn't support preallocation (e.g. on
-               OpenSolaris).  Since preallocation is just an
-               optimisation, ignore it. */
-            if (errno && errno != EINVAL)
-                throw SysError(format("preallocating file of %1% bytes") % len);
-        }
-#endif
+        add(path, NarMember::tpRegular);
     }
 
-    void receiveContents(unsigned char * data, unsigned int len)
+    void isExecutable()
     {
-        writeFull(fd, data, len);
+        index.back().executable = true;
     }
 
-    void finalizeContents(unsigned long long size)
+    void preallocateContents(unsigned long long size)
     {
-        errno = ftruncate(fd, size);
-        if (errno) throw SysError(format("truncating file to its allocated length of %1% bytes") % size);
+        index.back().offset = source.pos;
+        index.back().size = size;
     }
 
     void createSymlink(const Path & path, const string & target)
     {
-        Path p = dstPath + path;
-        if (symlink(target.c_str(), p.c_str()) == -1)
-            throw SysError(format("creating symlink `%1%'") % p);
+        NarMember & member(add(path, NarMember::tpSymlink));
+        member.offset = source.pos - ((target.size() + 7) & ~7ULL);
+        member.size = target.size();
     }
 };
 
- 
-void restorePath(const Path & path, Source & source)
+
+void indexNar(Source & source, NarIndex & index)
 {
-    RestoreSink sink;
-    sink.dstPath = path;
-    parseDump(sink, source);
+    CountingSource source2(source);
+    IndexSink sink(source2, index);
+    parseDump(sink, source2);
+}
+
+
+string unparseNarIndex(const NarIndex & index)
+{
+    string s = "nar-index-1\n";
+    foreach (NarIndex::const_iterator, i, index) {
+        if (i->path.find('\n') != string::npos)
+            throw Error(format("cannot index `%1%': file name contains a newline") % i->path);
+        s += (format("%1% %2% %3% %4%\n")
+            % (i->type == NarMember::tpDirectory ? "directory" :
+               i->type == NarMember::tpSymlink ? "symlink" :
+               i->executable ? "executable" : "regular")
+            % i->offset % i->size % i->path).str();
+    }
+    return s;
+}
+
+
+NarIndex parseNarIndex(const string & s)
+{
+    NarIndex index;
+    string::size_type pos = s.find('\n');
+
+    if (pos == string::npos || string(s, 0, pos) != "nar-index-1")
+        throw Error("not a NAR index");
+
+    while (++pos < s.size()) {
+        string::size_type end = s.find('\n', pos);
+        if (end == string::npos) throw Error("bad NAR index: incomplete line");
+        string line(s, pos, end - pos);
+        pos = end;
+
+        string::size_type p1 = line.find(' ');
+        string::size_type p2 = p1 == string::npos ? p1 : line.find(' ', p1 + 1);
+        string::size_type p3 = p2 == string::npos ? p2 : line.find(' ', p2 + 1);
+        if (p3 == string::npos)
+            throw Error(format("bad NAR index line `%1%'") % line);
+
+        NarMember member;
+        string type(line, 0, p1);
+        if (type == "regular") member.type = NarMember::tpRegular;
+        else if (type == "executable") {
+            member.type = NarMember::tpRegular;
+            member.executable = true;
+        }
+        else if (type == "directory") member.type = NarMember::tpDirectory;
+        else if (type == "symlink") member.type = NarMember::tpSymlink;
+        else throw Error(format("bad NAR index line `%1%'") % line);
+
+        if (!string2Int(string(line, p1 + 1, p2 - p1 - 1), member.offset) ||
+            !string2Int(string(line, p2 + 1, p3 - p2 - 1), member.size))
+            throw Error(format("bad NAR index line `%1%'") % line);
+
+        member.path = string(line, p3 + 1);
+        index.push_back(member);
+    }
+
+    return index;
 }
 
  
@@ -3,6 +3,7 @@
 
 #include "types.hh"
 #include "serialise.hh"
+#include "util.hh"
 
 
 namespace nix {
@@ -56,6 +57,11 @@ extern PathFilter defaultPathFilter;
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* Return the size of the NAR serialisation of `path', i.e. the number
+   of bytes that dumpPath() would produce.  This only needs to stat
+   the files, not read them. */
+unsigned long long computeNarSize(const Path & path);
+
 struct ParseSink
 {
     virtual void createDirectory(const Path & path) { };
@@ -71,7 +77,75 @@ struct ParseSink
     
 void parseDump(ParseSink & sink, Source & source);
 
-void restorePath(const Path & path, Source & source);
+
+/* A sink that recreates the archive at `dstPath'.  finish() must be
+   called once the archive has been parsed. */
+struct RestoreSink : ParseSink
+{
+    Path dstPath;
+    AutoCloseFD fd;
+
+    /* Whether to give everything the metadata of paths in the Nix
+       store (see canonicalisePathMetaData()) as it is created, rather
+       than in a separate pass over the result.  Files are created
+       read-only and get a modification time of 1 when they're closed.
+       Directories must stay writable until they're complete, so they
+       are done by finish(). */
+    bool canonicalise;
+
+    RestoreSink() : canonicalise(false), checkedUmask(false) { }
+
+    void createDirectory(const Path & path);
+    void createRegularFile(const Path & path);
+    void isExecutable();
+    void preallocateContents(unsigned long long size);
+    void receiveContents(unsigned char * data, unsigned int len);
+    void finalizeContents(unsigned long long size);
+    void createSymlink(const Path & path, const string & target);
+
+    /* Close the last file, and apply the deferred metadata. */
+    void finish();
+
+private:
+    Path curFile;
+    Paths dirs;
+    bool checkedUmask, umaskHidesRead;
+    void closeFile();
+};
+
+void restorePath(const Path & path, Source & source, bool canonicalise = false);
+
+
+/* A member of a NAR.  For regular files and symlinks, `offset' and
+   `size' give the position of the contents or the symlink target in
+   the NAR, so that they can be read without parsing the archive. */
+struct NarMember
+{
+    typedef enum { tpRegular, tpDirectory, tpSymlink } Type;
+    Path path; /* relative to the root of the NAR, which is `/' */
+    Type type;
+    bool executable;
+    unsigned long long offset, size;
+    NarMember() : type(tpRegular), executable(false), offset(0), size(0) { }
+};
+
+/* The members of a NAR, in the order in which they appear. */
+typedef list<NarMember> NarIndex;
+
+/* Like dumpPath(), but also record the members of the archive in
+   `index'. */
+void dumpPath(const Path & path, Sink & sink, NarIndex & index,
+    PathFilter & filter = defaultPathFilter);
+
+/* Compute the index of the NAR read from `source'. */
+void indexNar(Source & source, NarIndex & index);
+
+/* Convert a NAR index to and from the format of index files, which
+   is the line `nar-index-1' followed by a line `TYPE OFFSET SIZE
+   PATH' for every member, TYPE being `regular', `executable',
+   `directory' or `symlink'. */
+string unparseNarIndex(const NarIndex & index);
+NarIndex parseNarIndex(const string & s);
 
  
 }
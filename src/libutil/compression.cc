@@ -0,0 +1,187 @@
+#include "compression.hh"
+#include "util.hh"
+
+#include <cstring>
+#include <algorithm>
+
+#include <bzlib.h>
+
+
+namespace nix {
+
+
+struct BzipStream : bz_stream
+{
+    BzipStream()
+    {
+        memset((bz_stream *) this, 0, sizeof(bz_stream));
+    }
+};
+
+
+BzipSink::BzipSink(Sink & next) : next(next), finished(false)
+{
+    strm = new BzipStream;
+    /* Block size 9 (900 KB), like `bzip2' does by default. */
+    if (BZ2_bzCompressInit(strm, 9, 0, 0) != BZ_OK) {
+        delete strm;
+        throw Error("unable to initialise bzip2 compression");
+    }
+}
+
+
+BzipSink::~BzipSink()
+{
+    BZ2_bzCompressEnd(strm);
+    delete strm;
+}
+
+
+void BzipSink::compress(int action)
+{
+    unsigned char buf[65536];
+
+    while (true) {
+        checkInterrupt();
+
+        strm->next_out = (char *) buf;
+        strm->avail_out = sizeof(buf);
+
+        int res = BZ2_bzCompress(strm, action);
+        if (res != BZ_RUN_OK && res != BZ_FINISH_OK && res != BZ_STREAM_END)
+            throw Error(format("bzip2 compression failed (error %1%)") % res);
+
+        if (strm->avail_out < sizeof(buf))
+            next(buf, sizeof(buf) - strm->avail_out);
+
+        if (action == BZ_RUN ? strm->avail_in == 0 : res == BZ_STREAM_END)
+            break;
+    }
+}
+
+
+void BzipSink::operator () (const unsigned char * data, unsigned int len)
+{
+    assert(!finished);
+    /* BZ2_bzCompress() treats a call that makes no progress as an
+       error. */
+    if (len == 0) return;
+    strm->next_in = (char *) data;
+    strm->avail_in = len;
+    compress(BZ_RUN);
+}
+
+
+void BzipSink::finish()
+{
+    assert(!finished);
+    strm->avail_in = 0;
+    compress(BZ_FINISH);
+    finished = true;
+}
+
+
+DecompressionSource::DecompressionSource(Source & source)
+    : source(source), state(stStart), strm(0), startPos(0), startLen(0)
+{
+}
+
+
+DecompressionSource::~DecompressionSource()
+{
+    if (strm) {
+        BZ2_bzDecompressEnd(strm);
+        delete strm;
+    }
+}
+
+
+void DecompressionSource::operator () (unsigned char * data, unsigned int len)
+{
+    while (len) {
+        unsigned int n = read(data, len);
+        data += n; len -= n;
+    }
+}
+
+
+unsigned int DecompressionSource::read(unsigned char * data, unsigned int len)
+{
+    if (len == 0) return 0;
+
+    if (state == stStart) {
+        /* A bzip2 stream starts with `BZh' and the block size. */
+        source(start, sizeof(start));
+        startLen = sizeof(start);
+        if (start[0] == 'B' && start[1] == 'Z' && start[2] == 'h' &&
+            start[3] >= '1' && start[3] <= '9')
+        {
+            strm = new BzipStream;
+            if (BZ2_bzDecompressInit(strm, 0, 0) != BZ_OK) {
+                delete strm;
+                strm = 0;
+                throw Error("unable to initialise bzip2 decompression");
+            }
+            strm->next_in = (char *) start;
+            strm->avail_in = startLen;
+            state = stCompressed;
+        } else
+            state = stPlain;
+    }
+
+    if (state == stPlain) {
+        if (startPos < startLen) {
+            unsigned int n = std::min(len, startLen - startPos);
+            memcpy(data, start + startPos, n);
+            startPos += n;
+            return n;
+        }
+        return source.read(data, len);
+    }
+
+    if (state == stFinished) {
+        /* The caller wants more data than the first stream holds, so
+           the input may consist of several concatenated bzip2 streams
+           (as produced by `pbzip2', for instance).  Like `bunzip2',
+           decompress the next one. */
+        char * nextIn = strm->next_in;
+        unsigned int availIn = strm->avail_in;
+        BZ2_bzDecompressEnd(strm);
+        if (BZ2_bzDecompressInit(strm, 0, 0) != BZ_OK) {
+            delete strm;
+            strm = 0;
+            throw Error("unable to initialise bzip2 decompression");
+        }
+        strm->next_in = nextIn;
+        strm->avail_in = availIn;
+        state = stCompressed;
+    }
+
+    strm->next_out = (char *) data;
+    strm->avail_out = len;
+
+    while (strm->avail_out == len) {
+        checkInterrupt();
+
+        if (strm->avail_in == 0) {
+            strm->next_in = (char *) inBuf;
+            strm->avail_in = source.read(inBuf, sizeof(inBuf));
+        }
+
+        int res = BZ2_bzDecompress(strm);
+        if (res == BZ_STREAM_END) {
+            state = stFinished;
+            break;
+        }
+        if (res != BZ_OK)
+            throw Error(format("bzip2 data is corrupt (error %1%)") % res);
+    }
+
+    unsigned int n = len - strm->avail_out;
+    /* A stream can end without producing more output. */
+    if (n == 0) return read(data, len);
+    return n;
+}
+
+
+}
@@ -0,0 +1,65 @@
+#ifndef __COMPRESSION_H
+#define __COMPRESSION_H
+
+#include "serialise.hh"
+
+
+namespace nix {
+
+
+struct BzipStream;
+
+
+/* A sink that compresses the data written to it with bzip2 and
+   writes the result to `next'.  The output is an ordinary bzip2
+   stream, so it can be decompressed with `bunzip2'.  finish() must be
+   called after the last write. */
+struct BzipSink : Sink
+{
+    Sink & next;
+    BzipStream * strm;
+    bool finished;
+
+    BzipSink(Sink & next);
+    ~BzipSink();
+
+    void operator () (const unsigned char * data, unsigned int len);
+
+    void finish();
+
+private:
+    void compress(int action);
+};
+
+
+/* A source that reads data from `source' and decompresses it if it
+   starts with the bzip2 magic number.  Anything else is passed
+   through unchanged.  Concatenated bzip2 streams are decompressed
+   one after the other, but only as far as the caller asks for data,
+   so reading the last stream does not block waiting for more input.
+   Some data after the end of the compressed input may have been
+   consumed from `source', however. */
+struct DecompressionSource : Source
+{
+    Source & source;
+
+    DecompressionSource(Source & source);
+    ~DecompressionSource();
+
+    void operator () (unsigned char * data, unsigned int len);
+
+    unsigned int read(unsigned char * data, unsigned int len);
+
+private:
+    enum { stStart, stPlain, stCompressed, stFinished } state;
+    BzipStream * strm;
+    unsigned char start[4];
+    unsigned int startPos, startLen;
+    unsigned char inBuf[65536];
+};
+
+
+}
+
+
+#endif /* !__COMPRESSION_H */
@@ -68,11 +68,15 @@ Hash hashString(HashType ht, const string & s);
 /* Compute the hash of the given file. */
 Hash hashFile(HashType ht, const Path & path);
 
+/* A hash together with the number of bytes that were hashed. */
+typedef std::pair<Hash, unsigned long long> HashResult;
+
 /* Compute the hash of the given path.  The hash is defined as
-   (essentially) hashString(ht, dumpPath(path)). */
+   (essentially) hashString(ht, dumpPath(path)).  The second
+   component of the result is the size of the NAR serialisation. */
 struct PathFilter;
 extern PathFilter defaultPathFilter;
-Hash hashPath(HashType ht, const Path & path,
+HashResult hashPath(HashType ht, const Path & path,
     PathFilter & filter = defaultPathFilter);
 
 /* Compress a hash to the specified number of bytes by cyclically
@@ -93,12 +97,13 @@ class HashSink : public Sink
 private:
     HashType ht;
     Ctx * ctx;
+    unsigned long long bytes;
 
 public:
     HashSink(HashType ht);
     ~HashSink();
     virtual void operator () (const unsigned char * data, unsigned int len);
-    Hash finish();
+    HashResult finish();
 };
 
 
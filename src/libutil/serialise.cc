@@ -1,21 +1,183 @@
+#include "config.h"
+
 #include "serialise.hh"
 #include "util.hh"
 
 #include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 
 namespace nix {
 
 
-void FdSink::operator () (const unsigned char * data, unsigned int len)
+/* Pass bytes `offset' to `offset + len' of the file open on `fd' to
+   `sink'. */
+static void readFileToSink(int fd, off_t offset, unsigned long long len,
+    Sink & sink)
+{
+    unsigned char buf[65536];
+
+    while (len > 0) {
+        checkInterrupt();
+        ssize_t n = pread(fd, buf, len > sizeof(buf) ? sizeof(buf) : len, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading from file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+        sink(buf, n);
+        offset += n;
+        len -= n;
+    }
+}
+
+
+void Sink::sendFile(int fd, unsigned long long len)
+{
+    readFileToSink(fd, 0, len, *this);
+}
+
+
+BufferedSink::~BufferedSink()
+{
+    /* We can't call flush() here, because write() is a pure virtual
+       function by now.  Subclasses should flush themselves. */
+    delete[] buffer;
+}
+
+    
+void BufferedSink::operator () (const unsigned char * data, unsigned int len)
+{
+    if (!buffer) buffer = new unsigned char[bufSize];
+    
+    while (len) {
+        /* Optimisation: bypass the buffer if the data exceeds the
+           buffer size. */
+        if (bufPos == 0 && len >= bufSize) {
+            write(data, len);
+            break;
+        }
+        /* Otherwise, copy the bytes to the buffer.  Flush the buffer
+           when it's full. */
+        unsigned int n = bufPos + len > bufSize ? bufSize - bufPos : len;
+        memcpy(buffer + bufPos, data, n);
+        data += n; bufPos += n; len -= n;
+        if (bufPos == bufSize) flush();
+    }
+}
+
+
+void BufferedSink::flush()
+{
+    if (bufPos == 0) return;
+    unsigned int n = bufPos;
+    bufPos = 0; /* don't send the data again if write() throws */
+    write(buffer, n);
+}
+
+
+FdSink::~FdSink()
+{
+    try {
+        flush();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void FdSink::write(const unsigned char * data, unsigned int len)
 {
     writeFull(fd, data, len);
 }
 
 
-void FdSource::operator () (unsigned char * data, unsigned int len)
+void FdSink::sendFile(int fd, unsigned long long len)
 {
-    readFull(fd, data, len);
+    off_t offset = 0;
+
+#if HAVE_SYS_SENDFILE_H
+    /* The file contents must come after whatever is in the buffer. */
+    flush();
+
+    while ((unsigned long long) offset < len) {
+        checkInterrupt();
+        unsigned long long left = len - offset;
+        ssize_t n = ::sendfile(this->fd, fd, &offset,
+            left > 1 << 30 ? 1 << 30 : left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Not every kind of file descriptor supports sendfile()
+               (e.g. on Linux < 2.6.33, only sockets do).  Copy the
+               rest the slow way. */
+            if (errno == EINVAL || errno == ENOSYS) break;
+            throw SysError("writing to file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+    }
+#endif
+
+    readFileToSink(fd, offset, len - offset, *this);
+}
+
+
+BufferedSource::~BufferedSource()
+{
+    delete[] buffer;
+}
+
+
+void BufferedSource::operator () (unsigned char * data, unsigned int len)
+{
+    while (len) {
+        unsigned int n = read(data, len);
+        data += n; len -= n;
+    }
+}
+    
+
+unsigned int BufferedSource::read(unsigned char * data, unsigned int len)
+{
+    if (!buffer && bufSize) buffer = new unsigned char[bufSize];
+
+    if (!bufPosIn) {
+        /* Optimisation: bypass the buffer if the request is at least
+           as big as the buffer. */
+        if (len >= bufSize) return readUnbuffered(data, len);
+        bufPosIn = readUnbuffered(buffer, bufSize);
+    }
+            
+    /* Copy out the data in the buffer. */
+    unsigned int n = len > bufPosIn - bufPosOut ? bufPosIn - bufPosOut : len;
+    memcpy(data, buffer + bufPosOut, n);
+    bufPosOut += n;
+    if (bufPosIn == bufPosOut) bufPosIn = bufPosOut = 0;
+    return n;
+}
+
+
+bool BufferedSource::hasData()
+{
+    return bufPosOut < bufPosIn;
+}
+
+
+unsigned int FdSource::readUnbuffered(unsigned char * data, unsigned int len)
+{
+    ssize_t n;
+    do {
+        checkInterrupt();
+        n = ::read(fd, (char *) data, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) throw SysError("reading from file");
+    if (n == 0) throw EndOfFile("unexpected end-of-file");
+    return n;
 }
 
 
@@ -73,6 +235,14 @@ void writeStringSet(const StringSet & ss, Sink & sink)
 }
 
 
+void writeStrings(const Strings & ss, Sink & sink)
+{
+    writeInt(ss.size(), sink);
+    for (Strings::const_iterator i = ss.begin(); i != ss.end(); ++i)
+        writeString(*i, sink);
+}
+
+
 void readPadding(unsigned int len, Source & source)
 {
     if (len % 8) {
@@ -136,4 +306,14 @@ StringSet readStringSet(Source & source)
 }
 
 
+Strings readStrings(Source & source)
+{
+    unsigned int count = readInt(source);
+    Strings ss;
+    while (count--)
+        ss.push_back(readString(source));
+    return ss;
+}
+
+
 }
@@ -12,6 +12,13 @@ struct Sink
 {
     virtual ~Sink() { }
     virtual void operator () (const unsigned char * data, unsigned int len) = 0;
+
+    /* Write the first `len' bytes of the regular file open on `fd'.
+       The file offset of `fd' is neither used nor changed.  The
+       default implementation reads the file in blocks and passes
+       them to operator (); sinks that can move the data more cheaply
+       (e.g. with sendfile()) override this. */
+    virtual void sendFile(int fd, unsigned long long len);
 };
 
 
@@ -25,11 +32,69 @@ struct Source
        yet available, or throw an error if it is not going to be
        available. */
     virtual void operator () (unsigned char * data, unsigned int len) = 0;
+
+    /* Store up to `len' bytes in the buffer pointed to by `data', and
+       return the number of bytes stored.  It blocks until at least
+       one byte is available.  The default implementation stores
+       exactly `len' bytes. */
+    virtual unsigned int read(unsigned char * data, unsigned int len)
+    {
+        (*this)(data, len);
+        return len;
+    }
+};
+
+
+/* A sink that collects small writes in a buffer, and passes them to
+   write() in blocks of `bufSize' bytes.  The buffered data must be
+   sent explicitly by calling flush(), e.g., before waiting for a
+   reply from the other side. */
+struct BufferedSink : Sink
+{
+    unsigned int bufSize, bufPos;
+    unsigned char * buffer;
+
+    BufferedSink(unsigned int bufSize = 32 * 1024)
+        : bufSize(bufSize), bufPos(0), buffer(0) { }
+    ~BufferedSink();
+
+    void operator () (const unsigned char * data, unsigned int len);
+
+    void flush();
+
+    virtual void write(const unsigned char * data, unsigned int len) = 0;
+};
+
+
+/* A source that asks readUnbuffered() for blocks of `bufSize' bytes
+   at a time, and serves small reads from them.  Note that it may thus
+   consume more data from the underlying source than is read from
+   it. */
+struct BufferedSource : Source
+{
+    unsigned int bufSize, bufPosIn, bufPosOut;
+    unsigned char * buffer;
+
+    BufferedSource(unsigned int bufSize = 32 * 1024)
+        : bufSize(bufSize), bufPosIn(0), bufPosOut(0), buffer(0) { }
+    ~BufferedSource();
+
+    void operator () (unsigned char * data, unsigned int len);
+
+    unsigned int read(unsigned char * data, unsigned int len);
+
+    /* Like read(), but without buffering. */
+    virtual unsigned int readUnbuffered(unsigned char * data, unsigned int len) = 0;
+
+    /* Whether there is data in the buffer that hasn't been read
+       yet. */
+    bool hasData();
 };
 
 
-/* A sink that writes data to a file descriptor. */
-struct FdSink : Sink
+/* A sink that writes data to a file descriptor.  Any buffered data
+   is flushed when it's destroyed. */
+struct FdSink : BufferedSink
 {
     int fd;
 
@@ -42,13 +107,18 @@ struct FdSink : Sink
     {
         this->fd = fd;
     }
+
+    ~FdSink();
     
-    void operator () (const unsigned char * data, unsigned int len);
+    void write(const unsigned char * data, unsigned int len);
+
+    /* Copy the file to `fd' inside the kernel, if possible. */
+    void sendFile(int fd, unsigned long long len);
 };
 
 
 /* A source that reads data from a file descriptor. */
-struct FdSource : Source
+struct FdSource : BufferedSource
 {
     int fd;
 
@@ -62,7 +132,7 @@ struct FdSource : Source
         this->fd = fd;
     }
     
-    void operator () (unsigned char * data, unsigned int len);
+    unsigned int readUnbuffered(unsigned char * data, unsigned int len);
 };
 
 
@@ -77,6 +147,20 @@ struct StringSink : Sink
 };
 
 
+/* A source that passes all data read from it to a sink. */
+struct TeeSource : Source
+{
+    Source & orig;
+    Sink & sink;
+    TeeSource(Source & orig, Sink & sink) : orig(orig), sink(sink) { }
+    virtual void operator () (unsigned char * data, unsigned int len)
+    {
+        orig(data, len);
+        sink(data, len);
+    }
+};
+
+
 /* A source that reads data from a string. */
 struct StringSource : Source
 {
@@ -90,6 +174,13 @@ struct StringSource : Source
         if (pos > s.size())
             throw Error("end of string reached");
     }
+    virtual unsigned int read(unsigned char * data, unsigned int len)
+    {
+        if (pos >= s.size()) throw Error("end of string reached");
+        unsigned int n = s.copy((char *) data, len, pos);
+        pos += n;
+        return n;
+    }
 };
 
 
@@ -98,12 +189,14 @@ void writeInt(unsigned int n, Sink & sink);
 void writeLongLong(unsigned long long n, Sink & sink);
 void writeString(const string & s, Sink & sink);
 void writeStringSet(const StringSet & ss, Sink & sink);
+void writeStrings(const Strings & ss, Sink & sink);
 
 void readPadding(unsigned int len, Source & source);
 unsigned int readInt(Source & source);
 unsigned long long readLongLong(Source & source);
 string readString(Source & source);
 StringSet readStringSet(Source & source);
+Strings readStrings(Source & source);
 
 
 MakeError(SerialisationError, Error)
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
@@ -295,6 +296,99 @@ void computePathSize(const Path & path,
 }
 
 
+#if HAVE_UNLINKAT && HAVE_FDOPENDIR
+
+/* Delete the entry `name' of the directory open as `parentfd' (which
+   is `dir').  Everything is done relative to directory file descriptors,
+   so the kernel doesn't have to resolve full path names.  `type' is
+   the entry's d_type, or DT_UNKNOWN.  Directories aren't counted in
+   the bytes and blocks freed, so they don't need to be stat()ed if
+   readdir() tells us that they're directories. */
+static void _deletePath(int parentfd, const Path & dir, const string & name,
+    unsigned char type, unsigned long long & bytesFreed,
+    unsigned long long & blocksFreed)
+{
+    checkInterrupt();
+
+    Path path = dir + "/" + name;
+
+    printMsg(lvlVomit, format("%1%") % path);
+
+    if (type != DT_DIR) {
+        struct stat st;
+        if (fstatat(parentfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+            throw SysError(format("getting attributes of path `%1%'") % path);
+
+        if (!S_ISDIR(st.st_mode)) {
+            if (st.st_nlink == 1) {
+                bytesFreed += st.st_size;
+                blocksFreed += st.st_blocks;
+            }
+            if (unlinkat(parentfd, name.c_str(), 0) == -1)
+                throw SysError(format("cannot unlink `%1%'") % path);
+            return;
+        }
+    }
+
+    AutoCloseFD fd = openat(parentfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1)
+        throw SysError(format("opening directory `%1%'") % path);
+
+    /* Make the directory writable. */
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("getting attributes of path `%1%'") % path);
+    if (!(st.st_mode & S_IWUSR)) {
+        if (fchmod(fd, st.st_mode | S_IWUSR) == -1)
+            throw SysError(format("making `%1%' writable") % path);
+    }
+
+    /* Read the entries first, since deleting entries while reading
+       the directory has unspecified results.  fdopendir() takes
+       ownership of its argument, hence the dup(). */
+    std::vector<std::pair<string, unsigned char> > entries;
+    {
+        int fd2 = dup(fd);
+        if (fd2 == -1) throw SysError("duplicating file descriptor");
+        AutoCloseDir d(fdopendir(fd2));
+        if (!d) {
+            close(fd2);
+            throw SysError(format("opening directory `%1%'") % path);
+        }
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(d)) {
+            checkInterrupt();
+            string s = dirent->d_name;
+            if (s == "." || s == "..") continue;
+            entries.push_back(std::pair<string, unsigned char>(s, dirent->d_type));
+        }
+        if (errno) throw SysError(format("reading directory `%1%'") % path);
+    }
+
+    for (std::vector<std::pair<string, unsigned char> >::iterator i = entries.begin();
+         i != entries.end(); ++i)
+        _deletePath(fd, path, i->first, i->second, bytesFreed, blocksFreed);
+
+    fd.close();
+
+    if (unlinkat(parentfd, name.c_str(), AT_REMOVEDIR) == -1)
+        throw SysError(format("cannot unlink `%1%'") % path);
+}
+
+
+static void _deletePath(const Path & path, unsigned long long & bytesFreed,
+    unsigned long long & blocksFreed)
+{
+    Path dir = dirOf(path);
+    AutoCloseFD fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        throw SysError(format("opening directory `%1%'") % dir);
+    _deletePath(fd, dir == "/" ? "" : dir, baseNameOf(path),
+        DT_UNKNOWN, bytesFreed, blocksFreed);
+}
+
+#else
+
 static void _deletePath(const Path & path, unsigned long long & bytesFreed,
     unsigned long long & blocksFreed)
 {
@@ -328,6 +422,8 @@ static void _deletePath(const Path & path, unsigned long long & bytesFreed,
         throw SysError(format("cannot unlink `%1%'") % path);
 }
 
+#endif
+
 
 void deletePath(const Path & path)
 {
@@ -1067,4 +1163,13 @@ void ignoreException()
 }
 
  
+
+double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
 }
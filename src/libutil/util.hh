@@ -319,6 +319,11 @@ bool endOfList(std::istream & str);
 void ignoreException();
 
 
+/* Return the current time in seconds (with microsecond resolution),
+   for measuring how long something took. */
+double getTime();
+
+
 }
 
 
@@ -0,0 +1,199 @@
+#include "worker-pool.hh"
+
+#include <iostream>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+
+namespace nix {
+
+
+WorkerPool::WorkerPool(WorkerHandler & handler, unsigned int maxWorkers)
+    : handler(handler), maxWorkers(maxWorkers), haveReply(false)
+{
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    /* Workers that are still busy (e.g. because the caller was
+       interrupted) are killed by the Pid destructor. */
+    try {
+        foreach (Workers::iterator, i, workers)
+            if (!i->second.busy) {
+                i->second.to.close();
+                i->second.pid.wait(true);
+            }
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void WorkerPool::startWorker(Worker & worker)
+{
+    Pipe toPipe, fromPipe;
+
+    toPipe.create();
+    fromPipe.create();
+
+    worker.pid = fork();
+
+    switch (worker.pid) {
+
+    case -1:
+        throw SysError("unable to fork");
+
+    case 0: /* child */
+        try {
+            /* Close everything else, in particular the pipes to the
+               other workers, so that they see EOF when the parent
+               closes them. */
+            set<int> fds;
+            fds.insert(toPipe.readSide);
+            fds.insert(fromPipe.writeSide);
+            closeMostFDs(fds);
+
+            while (true) {
+                string request;
+                try {
+                    request = readLine(toPipe.readSide);
+                } catch (Error & e) {
+                    /* EOF means we're done. */
+                    break;
+                }
+                writeLine(fromPipe.writeSide, handler(request));
+            }
+        } catch (std::exception & e) {
+            std::cerr << "error: " << e.what() << std::endl;
+        }
+        quickExit(0);
+    }
+
+    /* Parent. */
+    worker.to = toPipe.writeSide.borrow();
+    worker.from = fromPipe.readSide.borrow();
+}
+
+
+bool WorkerPool::haveIdleWorker()
+{
+    if (maxWorkers == 0) return !haveReply;
+    if (workers.size() < maxWorkers) return true;
+    foreach (Workers::iterator, i, workers)
+        if (!i->second.busy) return true;
+    return false;
+}
+
+
+bool WorkerPool::busy()
+{
+    if (maxWorkers == 0) return haveReply;
+    foreach (Workers::iterator, i, workers)
+        if (i->second.busy) return true;
+    return false;
+}
+
+
+void WorkerPool::submit(const string & request)
+{
+    if (maxWorkers == 0) {
+        assert(!haveReply);
+        this->request = request;
+        reply = handler(request);
+        haveReply = true;
+        return;
+    }
+
+    for (unsigned int n = 0; n < maxWorkers; ++n) {
+        Worker & worker(workers[n]);
+        if (worker.busy) continue;
+        if (worker.pid == -1) startWorker(worker);
+        worker.busy = true;
+        worker.request = request;
+        writeLine(worker.to, request);
+        return;
+    }
+
+    throw Error("no idle worker process");
+}
+
+
+void WorkerPool::getReply(string & request, string & reply)
+{
+    if (maxWorkers == 0) {
+        assert(haveReply);
+        request = this->request;
+        reply = this->reply;
+        haveReply = false;
+        return;
+    }
+
+    while (true) {
+        checkInterrupt();
+
+        /* Return a reply that has been read completely. */
+        foreach (Workers::iterator, i, workers) {
+            Worker & worker(i->second);
+            if (!worker.busy) continue;
+            string::size_type end = worker.buffer.find('\n');
+            if (end == string::npos) continue;
+            request = worker.request;
+            reply = string(worker.buffer, 0, end);
+            worker.buffer.erase(0, end + 1);
+            worker.busy = false;
+            return;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        int fdMax = 0;
+        foreach (Workers::iterator, i, workers)
+            if (i->second.busy) {
+                FD_SET(i->second.from, &fds);
+                if (i->second.from >= fdMax) fdMax = i->second.from + 1;
+            }
+
+        if (fdMax == 0) throw Error("no outstanding requests");
+
+        if (select(fdMax, &fds, 0, 0, 0) == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("waiting for worker processes");
+        }
+
+        /* Read as much as is available, rather than a byte at a
+           time, since replies can be large. */
+        foreach (Workers::iterator, i, workers) {
+            Worker & worker(i->second);
+            if (!worker.busy || !FD_ISSET(worker.from, &fds)) continue;
+            char buf[65536];
+            ssize_t rd = read(worker.from, buf, sizeof(buf));
+            if (rd == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading from worker process");
+            }
+            if (rd == 0)
+                throw Error(format("worker process %1% died while processing `%2%'")
+                    % (pid_t) worker.pid % worker.request);
+            worker.buffer.append(buf, rd);
+        }
+    }
+}
+
+
+void WorkerPool::shutdown()
+{
+    foreach (Workers::iterator, i, workers) {
+        i->second.to.close();
+        int status = i->second.pid.wait(true);
+        if (!statusOk(status))
+            throw Error(format("worker process %1%") % statusToString(status));
+    }
+    workers.clear();
+}
+
+
+}
@@ -0,0 +1,84 @@
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include "util.hh"
+
+#include <map>
+
+
+namespace nix {
+
+
+/* Callback that processes a request in a worker process. */
+struct WorkerHandler
+{
+    virtual ~WorkerHandler() { }
+
+    /* Process `request' and return the reply.  Neither may contain
+       newlines.  Errors should be turned into replies, since an
+       uncaught exception terminates the worker. */
+    virtual string operator () (const string & request) = 0;
+};
+
+
+/* A pool of up to `maxWorkers' forked worker processes that run a
+   WorkerHandler on requests sent to them over a pipe.  Each worker
+   handles one request at a time, so at most `maxWorkers' requests
+   are outstanding.  The workers are started lazily.  If `maxWorkers'
+   is 0, requests are handled synchronously in the calling process.
+
+   The handler runs in a forked copy of the calling process, so it
+   must not use resources that cannot be shared with the parent (such
+   as the Nix database). */
+class WorkerPool
+{
+public:
+    WorkerPool(WorkerHandler & handler, unsigned int maxWorkers);
+    ~WorkerPool();
+
+    /* Whether a request can be submitted without blocking. */
+    bool haveIdleWorker();
+
+    /* Whether any requests are outstanding. */
+    bool busy();
+
+    /* Send a request to an idle worker. */
+    void submit(const string & request);
+
+    /* Wait until some worker has finished its request, and return the
+       request and the reply. */
+    void getReply(string & request, string & reply);
+
+    /* Shut down the workers and wait for them to exit. */
+    void shutdown();
+
+private:
+
+    struct Worker
+    {
+        Pid pid;
+        AutoCloseFD to, from;
+        bool busy;
+        string request;
+        string buffer; /* data read from `from' but not yet returned */
+        Worker() : busy(false) { }
+    };
+
+    typedef std::map<unsigned int, Worker> Workers;
+
+    WorkerHandler & handler;
+    unsigned int maxWorkers;
+    Workers workers;
+
+    /* Synchronous mode. */
+    bool haveReply;
+    string request, reply;
+
+    void startWorker(Worker & worker);
+};
+
+
+}
+
+
+#endif /* !__WORKER_POOL_H */
@@ -1,6 +1,7 @@
 #include "globals.hh"
 #include "misc.hh"
 #include "archive.hh"
+#include "compression.hh"
 #include "shared.hh"
 #include "dotgraph.hh"
 #include "xmlgraph.hh"
@@ -11,6 +12,11 @@
 #include <iostream>
 #include <algorithm>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 
 using namespace nix;
 using std::cin;
@@ -222,12 +228,23 @@ static void printTree(const Path & path,
 }
 
 
+/* Return the NAR size of `path' as recorded in the database. */
+static unsigned long long queryNarSize(const Path & path)
+{
+    ValidPathInfo info = store->queryPathInfo(path);
+    if (info.narSize == 0)
+        throw Error(format("the size of `%1%' is not known; run `nix-store --verify' to compute it")
+            % path);
+    return info.narSize;
+}
+
+
 /* Perform various sorts of queries. */
 static void opQuery(Strings opFlags, Strings opArgs)
 {
     enum { qOutputs, qRequisites, qReferences, qReferrers
-         , qReferrersClosure, qDeriver, qBinding, qHash
-         , qTree, qGraph, qXml, qResolve, qRoots } query = qOutputs;
+         , qReferrersClosure, qDeriver, qBinding, qHash, qSize
+         , qClosureSize, qTree, qGraph, qXml, qResolve, qRoots } query = qOutputs;
     bool useOutput = false;
     bool includeOutputs = false;
     bool forceRealise = false;
@@ -248,6 +265,8 @@ static void opQuery(Strings opFlags, Strings opArgs)
             query = qBinding;
         }
         else if (*i == "--hash") query = qHash;
+        else if (*i == "--size") query = qSize;
+        else if (*i == "--closure-size") query = qClosureSize;
         else if (*i == "--tree") query = qTree;
         else if (*i == "--graph") query = qGraph;
         else if (*i == "--xml") query = qXml;
@@ -318,6 +337,25 @@ static void opQuery(Strings opFlags, Strings opArgs)
             }
             break;
 
+        case qSize:
+            foreach (Strings::iterator, i, opArgs) {
+                Path path = maybeUseOutput(followLinksToStorePath(*i), useOutput, forceRealise);
+                cout << format("%1%\n") % queryNarSize(path);
+            }
+            break;
+
+        case qClosureSize:
+            foreach (Strings::iterator, i, opArgs) {
+                Path path = maybeUseOutput(followLinksToStorePath(*i), useOutput, forceRealise);
+                PathSet closure;
+                computeFSClosure(path, closure, false, includeOutputs);
+                unsigned long long size = 0;
+                foreach (PathSet::iterator, j, closure)
+                    size += queryNarSize(*j);
+                cout << format("%1%\n") % size;
+            }
+            break;
+
         case qTree: {
             PathSet done;
             foreach (Strings::iterator, i, opArgs)
@@ -392,10 +430,15 @@ static void opDumpDB(Strings opFlags, Strings opArgs)
     if (!opFlags.empty()) throw UsageError("unknown flag");
     if (!opArgs.empty())
         throw UsageError("no arguments expected");
-    PathSet validPaths = store->queryValidPaths();
-    foreach (PathSet::iterator, i, validPaths) {
-        cout << makeValidityRegistration(singleton<PathSet>(*i), true, true);
-    }
+    struct DumpPath : PathCallback
+    {
+        void operator () (const Path & path)
+        {
+            cout << makeValidityRegistration(singleton<PathSet>(path), true, true);
+        }
+    };
+    DumpPath dumpPath;
+    store->enumerateValidPaths(dumpPath);
 }
 
 
@@ -410,8 +453,11 @@ static void registerValidity(bool reregister, bool hashGiven, bool canonicalise)
             /* !!! races */
             if (canonicalise)
                 canonicalisePathMetaData(info.path);
-            if (!hashGiven)
-                info.hash = hashPath(htSHA256, info.path);
+            if (!hashGiven) {
+                HashResult hash = hashPath(htSHA256, info.path);
+                info.hash = hash.first;
+                info.narSize = hash.second;
+            }
             infos.push_back(info);
         }
     }
@@ -491,9 +537,42 @@ struct PrintFreed
 };
 
 
+/* Print the GC roots, ordered by the amount of disk space that
+   removing each would free, and the amount of disk space that a
+   garbage collection would free now. */
+static void printImpact()
+{
+    Roots roots = store->findRoots();
+
+    std::map<Path, unsigned long long> impact;
+    unsigned long long live = computeRootImpact(roots, impact);
+
+    vector<std::pair<unsigned long long, Path> > sorted;
+    foreach (Roots::iterator, i, roots)
+        sorted.push_back(std::pair<unsigned long long, Path>(impact[i->first], i->first));
+    sort(sorted.begin(), sorted.end());
+
+    for (vector<std::pair<unsigned long long, Path> >::reverse_iterator i = sorted.rbegin();
+         i != sorted.rend(); ++i)
+        cout << format("%1% %2% -> %3%\n") % i->first % i->second % roots[i->second];
+
+    GCOptions options;
+    options.action = GCOptions::gcReturnDead;
+    GCResults results;
+    store->collectGarbage(options, results);
+
+    unsigned long long dead = 0;
+    foreach (PathSet::iterator, i, results.paths)
+        if (store->isValidPath(*i)) dead += store->queryPathInfo(*i).narSize;
+
+    printMsg(lvlInfo, format("%1% bytes reachable from %2% roots, %3% bytes in %4% paths reclaimable now")
+        % live % roots.size() % dead % results.paths.size());
+}
+
+
 static void opGC(Strings opFlags, Strings opArgs)
 {
-    bool printRoots = false;
+    bool printRoots = false, printImpact_ = false;
     GCOptions options;
     options.action = GCOptions::gcDeleteDead;
     
@@ -502,6 +581,7 @@ static void opGC(Strings opFlags, Strings opArgs)
     /* Do what? */
     foreach (Strings::iterator, i, opFlags)
         if (*i == "--print-roots") printRoots = true;
+        else if (*i == "--print-impact") printImpact_ = true;
         else if (*i == "--print-live") options.action = GCOptions::gcReturnLive;
         else if (*i == "--print-dead") options.action = GCOptions::gcReturnDead;
         else if (*i == "--delete") options.action = GCOptions::gcDeleteDead;
@@ -510,6 +590,10 @@ static void opGC(Strings opFlags, Strings opArgs)
             options.maxFreed = maxFreed >= 1 ? maxFreed : 1;
         }
         else if (*i == "--max-links") options.maxLinks = getIntArg<unsigned int>(*i, i, opFlags.end());
+        else if (*i == "--slice-time") options.sliceTime = getIntArg<unsigned int>(*i, i, opFlags.end());
+        else if (*i == "--slice-bytes") options.sliceBytes = getIntArg<unsigned long long>(*i, i, opFlags.end());
+        else if (*i == "--min-free") options.minFree = getIntArg<unsigned long long>(*i, i, opFlags.end());
+        else if (*i == "--max-store-size") options.maxStoreSize = getIntArg<unsigned long long>(*i, i, opFlags.end());
         else throw UsageError(format("bad sub-operation `%1%' in GC") % *i);
 
     if (!opArgs.empty()) throw UsageError("no arguments expected");
@@ -520,6 +604,8 @@ static void opGC(Strings opFlags, Strings opArgs)
             cout << i->first << " -> " << i->second << std::endl;
     }
 
+    else if (printImpact_) printImpact();
+
     else {
         PrintFreed freed(options.action == GCOptions::gcDeleteDead, results);
         store->collectGarbage(options, results);
@@ -556,12 +642,104 @@ static void opDelete(Strings opFlags, Strings opArgs)
    output. */
 static void opDump(Strings opFlags, Strings opArgs)
 {
-    if (!opFlags.empty()) throw UsageError("unknown flag");
+    Path indexFile;
+    bool compress = false;
+
+    for (Strings::iterator i = opFlags.begin(); i != opFlags.end(); ++i)
+        if (*i == "--index") {
+            if (++i == opFlags.end())
+                throw UsageError("`--index' requires an argument");
+            indexFile = *i;
+        }
+        else if (*i == "--bzip2") compress = true;
+        else throw UsageError(format("unknown flag `%1%'") % *i);
+
     if (opArgs.size() != 1) throw UsageError("only one argument allowed");
 
+    /* The offsets in an index refer to the uncompressed archive. */
+    if (compress && indexFile != "")
+        throw UsageError("`--index' cannot be used together with `--bzip2'");
+
     FdSink sink(STDOUT_FILENO);
     string path = *opArgs.begin();
-    dumpPath(path, sink);
+    if (compress) {
+        BzipSink bzipSink(sink);
+        dumpPath(path, bzipSink);
+        bzipSink.finish();
+    }
+    else if (indexFile == "")
+        dumpPath(path, sink);
+    else {
+        NarIndex index;
+        dumpPath(path, sink, index);
+        writeFile(indexFile, unparseNarIndex(index));
+    }
+    sink.flush();
+}
+
+
+/* Print the index of the Nix archive read from standard input. */
+static void opIndexNar(Strings opFlags, Strings opArgs)
+{
+    if (!opFlags.empty()) throw UsageError("unknown flag");
+    if (!opArgs.empty()) throw UsageError("no arguments expected");
+
+    FdSource source(STDIN_FILENO);
+    NarIndex index;
+    indexNar(source, index);
+    cout << unparseNarIndex(index);
+}
+
+
+/* Print the contents of a regular file or the target of a symlink in
+   a Nix archive, using an index of the archive to read only the
+   bytes needed. */
+static void opCatNar(Strings opFlags, Strings opArgs)
+{
+    unsigned long long offset = 0, length = 0;
+    bool haveLength = false;
+
+    foreach (Strings::iterator, i, opFlags)
+        if (*i == "--offset") offset = getIntArg<unsigned long long>(*i, i, opFlags.end());
+        else if (*i == "--length") {
+            length = getIntArg<unsigned long long>(*i, i, opFlags.end());
+            haveLength = true;
+        }
+        else throw UsageError(format("unknown flag `%1%'") % *i);
+
+    if (opArgs.size() != 3)
+        throw UsageError("`--cat-nar' requires an archive, its index and a path");
+    Strings::iterator i = opArgs.begin();
+    Path narFile = *i++;
+    Path indexFile = *i++;
+    Path path = *i++;
+    if (path.empty() || path[0] != '/') path = "/" + path;
+
+    NarIndex index = parseNarIndex(readFile(indexFile));
+
+    NarIndex::iterator member = index.begin();
+    while (member != index.end() && member->path != path) ++member;
+    if (member == index.end())
+        throw Error(format("`%1%' is not in the index `%2%'") % path % indexFile);
+    if (member->type == NarMember::tpDirectory)
+        throw Error(format("`%1%' is a directory") % path);
+
+    if (offset > member->size) offset = member->size;
+    if (!haveLength || length > member->size - offset)
+        length = member->size - offset;
+
+    AutoCloseFD fd = open(narFile.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening `%1%'") % narFile);
+    if (lseek(fd, member->offset + offset, SEEK_SET) == -1)
+        throw SysError(format("seeking in `%1%'") % narFile);
+
+    unsigned char buf[65536];
+    while (length > 0) {
+        size_t n = length > sizeof(buf) ? sizeof(buf) : length;
+        readFull(fd, buf, n);
+        writeFull(STDOUT_FILENO, buf, n);
+        length -= n;
+    }
 }
 
 
@@ -573,24 +751,38 @@ static void opRestore(Strings opFlags, Strings opArgs)
     if (opArgs.size() != 1) throw UsageError("only one argument allowed");
 
     FdSource source(STDIN_FILENO);
-    restorePath(*opArgs.begin(), source);
+    DecompressionSource source2(source);
+    restorePath(*opArgs.begin(), source2);
+}
+
+
+static void exportPaths(const Strings & paths, bool sign, Sink & sink)
+{
+    foreach (Strings::const_iterator, i, paths) {
+        writeInt(1, sink);
+        store->exportPath(*i, sign, sink);
+    }
+    writeInt(0, sink);
 }
 
 
 static void opExport(Strings opFlags, Strings opArgs)
 {
-    bool sign = false;
+    bool sign = false, compress = false;
     for (Strings::iterator i = opFlags.begin();
          i != opFlags.end(); ++i)
         if (*i == "--sign") sign = true;
+        else if (*i == "--bzip2") compress = true;
         else throw UsageError(format("unknown flag `%1%'") % *i);
 
     FdSink sink(STDOUT_FILENO);
-    for (Strings::iterator i = opArgs.begin(); i != opArgs.end(); ++i) {
-        writeInt(1, sink);
-        store->exportPath(*i, sign, sink);
-    }
-    writeInt(0, sink);
+    if (compress) {
+        BzipSink bzipSink(sink);
+        exportPaths(opArgs, sign, bzipSink);
+        bzipSink.finish();
+    } else
+        exportPaths(opArgs, sign, sink);
+    sink.flush();
 }
 
 
@@ -604,12 +796,10 @@ static void opImport(Strings opFlags, Strings opArgs)
     if (!opArgs.empty()) throw UsageError("no arguments expected");
     
     FdSource source(STDIN_FILENO);
-    while (true) {
-        unsigned long long n = readLongLong(source);
-        if (n == 0) break;
-        if (n != 1) throw Error("input doesn't look like something created by `nix-store --export'");
-        cout << format("%1%\n") % store->importPath(requireSignature, source) << std::flush;
-    }
+    Paths paths = store->importPaths(requireSignature, source);
+
+    foreach (Paths::iterator, i, paths)
+        cout << format("%1%\n") % *i << std::flush;
 }
 
 
@@ -631,13 +821,15 @@ static void opVerify(Strings opFlags, Strings opArgs)
         throw UsageError("no arguments expected");
 
     bool checkContents = false;
+    bool incremental = false;
     
     for (Strings::iterator i = opFlags.begin();
          i != opFlags.end(); ++i)
         if (*i == "--check-contents") checkContents = true;
+        else if (*i == "--incremental") incremental = true;
         else throw UsageError(format("unknown flag `%1%'") % *i);
     
-    ensureLocalStore().verifyStore(checkContents);
+    ensureLocalStore().verifyStore(checkContents, incremental);
 }
 
 
@@ -649,6 +841,12 @@ static void showOptimiseStats(OptimiseStats & stats)
         % stats.filesLinked
         % stats.sameContents
         % stats.totalFiles);
+    printMsg(lvlError,
+        format("%1% files were hashed completely; %2% bytes were read for hashing, out of %3% bytes scanned")
+        % stats.filesHashed % stats.bytesHashed % stats.bytesScanned);
+    if (stats.pathsSkipped)
+        printMsg(lvlError, format("skipped %1% paths that were optimised before")
+            % stats.pathsSkipped);
 }
 
 
@@ -677,6 +875,16 @@ static void opOptimise(Strings opFlags, Strings opArgs)
 }
 
 
+/* Compact the Nix database. */
+static void opVacuum(Strings opFlags, Strings opArgs)
+{
+    if (!opFlags.empty()) throw UsageError("unknown flag");
+    if (!opArgs.empty())
+        throw UsageError("no arguments expected");
+    ensureLocalStore().vacuumDB();
+}
+
+
 /* Scan the arguments; find the operation, set global flags, put all
    other flags in a list, and put all other arguments in another
    list. */
@@ -718,6 +926,10 @@ void run(Strings args)
             op = opDump;
         else if (arg == "--restore")
             op = opRestore;
+        else if (arg == "--index-nar")
+            op = opIndexNar;
+        else if (arg == "--cat-nar")
+            op = opCatNar;
         else if (arg == "--export")
             op = opExport;
         else if (arg == "--import")
@@ -728,6 +940,8 @@ void run(Strings args)
             op = opVerify;
         else if (arg == "--optimise")
             op = opOptimise;
+        else if (arg == "--vacuum")
+            op = opVacuum;
         else if (arg == "--add-root") {
             if (i == args.end())
                 throw UsageError("`--add-root requires an argument");
@@ -737,7 +951,10 @@ void run(Strings args)
             indirectRoot = true;
         else if (arg[0] == '-') {            
             opFlags.push_back(arg);
-            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
+            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime" ||
+                arg == "--slice-time" || arg == "--slice-bytes" ||
+                arg == "--min-free" || arg == "--max-store-size" ||
+                arg == "--index" || arg == "--offset" || arg == "--length") { /* !!! hack */
                 if (i != args.end()) opFlags.push_back(*i++);
             }
         }
@@ -750,7 +967,8 @@ void run(Strings args)
 
     if (!op) throw UsageError("no operation specified");
 
-    if (op != opDump && op != opRestore) /* !!! hack */
+    if (op != opDump && op != opRestore &&
+        op != opIndexNar && op != opCatNar) /* !!! hack */
         store = openStore();
 
     op(opFlags, opArgs);
@@ -57,6 +57,7 @@ static void tunnelStderr(const unsigned char * buf, size_t count)
         try {
             writeInt(STDERR_NEXT, to);
             writeString(string((char *) buf, count), to);
+            to.flush();
         } catch (...) {
             /* Write failed; that means that the other side is
                gone. */
@@ -196,14 +197,16 @@ static void stopWork(bool success = true, const string & msg = "")
 }
 
 
-struct TunnelSink : Sink
+/* Sends data to the client in STDERR_WRITE messages.  Small writes
+   are collected into messages of up to 32 KiB, so the data must be
+   flushed before calling stopWork(). */
+struct TunnelSink : BufferedSink
 {
     Sink & to;
     TunnelSink(Sink & to) : to(to)
     {
     }
-    virtual void operator ()
-        (const unsigned char * data, unsigned int len)
+    virtual void write(const unsigned char * data, unsigned int len)
     {
         writeInt(STDERR_WRITE, to);
         writeString(string((const char *) data, len), to);
@@ -211,14 +214,44 @@ struct TunnelSink : Sink
 };
 
 
-struct TunnelSource : Source
+/* Sends store paths to the client as newline-separated text through
+   the tunnel, in chunks of at most `bufSize' bytes. */
+struct TunnelPathCallback : PathCallback
+{
+    TunnelSink & sink;
+    string buf;
+    static const unsigned int bufSize = 32768;
+    TunnelPathCallback(TunnelSink & sink) : sink(sink)
+    {
+    }
+    void operator () (const Path & path)
+    {
+        buf += path;
+        buf += '\n';
+        if (buf.size() >= bufSize) flush();
+    }
+    void flush()
+    {
+        if (buf.empty()) return;
+        sink((const unsigned char *) buf.c_str(), buf.size());
+        buf.clear();
+    }
+};
+
+
+/* Asks the client for data with STDERR_READ messages.  Clients
+   since protocol version 1.12 may send less data than requested, so
+   then we ask for 32 KiB at a time rather than for each little bit
+   that is read. */
+struct TunnelSource : BufferedSource
 {
     Source & from;
-    TunnelSource(Source & from) : from(from)
+    TunnelSource(Source & from, unsigned int clientVersion)
+        : BufferedSource(GET_PROTOCOL_MINOR(clientVersion) >= 12 ? 32 * 1024 : 0)
+        , from(from)
     {
     }
-    virtual void operator ()
-        (unsigned char * data, unsigned int len)
+    virtual unsigned int readUnbuffered(unsigned char * data, unsigned int len)
     {
         /* Careful: we're going to receive data from the client now,
            so we have to disable the SIGPOLL handler. */
@@ -227,48 +260,13 @@ struct TunnelSource : Source
         
         writeInt(STDERR_READ, to);
         writeInt(len, to);
+        to.flush();
         string s = readString(from);
-        if (s.size() != len) throw Error("not enough data");
-        memcpy(data, (const unsigned char *) s.c_str(), len);
+        if (s.empty() || s.size() > len) throw Error("not enough data");
+        memcpy(data, (const unsigned char *) s.c_str(), s.size());
 
         startWork();
-    }
-};
-
-
-/* If the NAR archive contains a single file at top-level, then save
-   the contents of the file to `s'.  Otherwise barf. */
-struct RetrieveRegularNARSink : ParseSink
-{
-    string s;
-
-    void createDirectory(const Path & path)
-    {
-        throw Error("regular file expected");
-    }
-
-    void receiveContents(unsigned char * data, unsigned int len)
-    {
-        s.append((const char *) data, len);
-    }
-
-    void createSymlink(const Path & path, const string & target)
-    {
-        throw Error("regular file expected");
-    }
-};
-
-
-/* Adapter class of a Source that saves all data read to `s'. */
-struct SavingSourceAdapter : Source
-{
-    Source & orig;
-    string s;
-    SavingSourceAdapter(Source & orig) : orig(orig) { }
-    void operator () (unsigned char * data, unsigned int len)
-    {
-        orig(data, len);
-        s.append((const char *) data, len);
+        return s.size();
     }
 };
 
@@ -314,6 +312,19 @@ static void performOp(unsigned int clientVersion,
         break;
     }
 
+    case wopQueryPathInfo: {
+        Path path = readStorePath(from);
+        startWork();
+        ValidPathInfo info = store->queryPathInfo(path);
+        stopWork();
+        writeString(info.deriver, to);
+        writeString(printHash(info.hash), to);
+        writeStringSet(info.references, to);
+        writeInt(info.registrationTime, to);
+        writeLongLong(info.narSize, to);
+        break;
+    }
+
     case wopQueryReferences:
     case wopQueryReferrers: {
         Path path = readStorePath(from);
@@ -337,6 +348,18 @@ static void performOp(unsigned int clientVersion,
         break;
     }
 
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs: {
+        Path path = readStorePath(from);
+        startWork();
+        PathSet paths = op == wopQueryValidDerivers
+            ? store->queryValidDerivers(path)
+            : store->queryDerivationOutputs(path);
+        stopWork();
+        writeStringSet(paths, to);
+        break;
+    }
+
     case wopAddToStore: {
         string baseName = readString(from);
         bool fixed = readInt(from) == 1; /* obsolete */
@@ -349,22 +372,11 @@ static void performOp(unsigned int clientVersion,
         }
         HashType hashAlgo = parseHashType(s);
 
-        SavingSourceAdapter savedNAR(from);
-        RetrieveRegularNARSink savedRegular;
-        
-        if (recursive) {
-            /* Get the entire NAR dump from the client and save it to
-               a string so that we can pass it to
-               addToStoreFromDump(). */
-            ParseSink sink; /* null sink; just parse the NAR */
-            parseDump(sink, savedNAR);
-        } else {
-            parseDump(savedRegular, from);
-        }
-            
-        startWork();
+        /* The NAR is restored as it comes in, so stderr can't be
+           sent to the client until the operation has finished. */
         Path path = dynamic_cast<LocalStore *>(store.get())
-            ->addToStoreFromDump(recursive ? savedNAR.s : savedRegular.s, baseName, recursive, hashAlgo);
+            ->addToStoreFromDump(from, baseName, recursive, hashAlgo);
+        startWork();
         stopWork();
         
         writeString(path, to);
@@ -388,6 +400,7 @@ static void performOp(unsigned int clientVersion,
         startWork();
         TunnelSink sink(to);
         store->exportPath(path, sign, sink);
+        sink.flush();
         stopWork();
         writeInt(1, to);
         break;
@@ -395,13 +408,22 @@ static void performOp(unsigned int clientVersion,
 
     case wopImportPath: {
         startWork();
-        TunnelSource source(from);
+        TunnelSource source(from, clientVersion);
         Path path = store->importPath(true, source);
         stopWork();
         writeString(path, to);
         break;
     }
 
+    case wopImportPaths: {
+        startWork();
+        TunnelSource source(from, clientVersion);
+        Paths paths = store->importPaths(true, source);
+        stopWork();
+        writeStrings(paths, to);
+        break;
+    }
+
     case wopBuildDerivations: {
         PathSet drvs = readStorePaths(from);
         startWork();
@@ -470,6 +492,14 @@ static void performOp(unsigned int clientVersion,
             readInt(from);
             readInt(from);
         }
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 10) {
+            options.sliceTime = readInt(from);
+            options.sliceBytes = readLongLong(from);
+        }
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 11) {
+            options.minFree = readLongLong(from);
+            options.maxStoreSize = readLongLong(from);
+        }
 
         GCResults results;
         
@@ -508,6 +538,28 @@ static void performOp(unsigned int clientVersion,
         break;
     }
 
+    case wopQueryValidPaths: {
+        startWork();
+        TunnelSink sink(to);
+        TunnelPathCallback callback(sink);
+        store->enumerateValidPaths(callback);
+        callback.flush();
+        sink.flush();
+        stopWork();
+        break;
+    }
+
+    case wopQueryValidPathsAfter: {
+        Path after = readString(from);
+        if (after != "") assertStorePath(after);
+        unsigned int max = readInt(from);
+        startWork();
+        Paths paths = store->queryValidPathsAfter(after, max);
+        stopWork();
+        writeStrings(paths, to);
+        break;
+    }
+
     case wopQuerySubstitutablePathInfo: {
         Path path = absPath(readString(from));
         startWork();
@@ -552,6 +604,7 @@ static void processConnection()
     writeInt(WORKER_MAGIC_2, to);
 
     writeInt(PROTOCOL_VERSION, to);
+    to.flush();
     unsigned int clientVersion = readInt(from);
 
     /* Send startup error messages to the client. */
@@ -576,6 +629,7 @@ static void processConnection()
         
     } catch (Error & e) {
         stopWork(false, e.msg());
+        to.flush();
         return;
     }
 
@@ -583,6 +637,8 @@ static void processConnection()
     unsigned int opCount = 0;
     
     while (true) {
+        to.flush();
+
         WorkerOp op;
         try {
             op = (WorkerOp) readInt(from);
@@ -670,9 +726,8 @@ static void daemonLoop()
     while (1) {
 
         try {
-            /* Important: the server process *cannot* open the
-               Berkeley DB environment, because it doesn't like forks
-               very much. */
+            /* Important: the server process *cannot* open the SQLite
+               database, because it doesn't like forks very much. */
             assert(!store);
             
             /* Accept a connection. */
@@ -26,3 +26,8 @@ hash2=$($nixhash --type sha256 --base32 ./dummy)
 echo $hash2
 
 test "$hash1" = "sha256:$hash2"
+
+# The recorded NAR size must match the size of the actual dump.
+size1=$($nixstore -q --size $path1)
+size2=$($nixstore --dump $path1 | wc -c)
+test "$size1" = "$size2"
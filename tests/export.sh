@@ -29,3 +29,57 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 $nixstore --import < $TEST_ROOT/exp_all2
+
+
+clearStore
+
+# A failing import must not register the paths of the current batch
+# (paths are registered in batches of 256, so with this small export
+# that means none at all): cut off the end of the export so that
+# reading the last path fails.
+head -c -16 $TEST_ROOT/exp_all > $TEST_ROOT/exp_truncated
+
+if $nixstore --import < $TEST_ROOT/exp_truncated; then
+    echo "importing a truncated export should fail"
+    exit 1
+fi
+
+if test "$(echo "select count(*) from ValidPaths" | $sqlite3 ./test-tmp/db/db.sqlite)" -ne 0; then
+    echo "failed import left paths registered"
+    exit 1
+fi
+
+$nixstore --import < $TEST_ROOT/exp_all
+$nixstore --check-validity $outPath
+
+
+# Compressed exports are ordinary bzip2 streams, and are decompressed
+# automatically on import.
+$nixstore --export $($nixstore -qR $outPath) > $TEST_ROOT/exp_all3
+$nixstore --export --bzip2 $($nixstore -qR $outPath) > $TEST_ROOT/exp_all3.bz2
+$bzip2_bin_test/bunzip2 < $TEST_ROOT/exp_all3.bz2 | cmp - $TEST_ROOT/exp_all3
+
+clearStore
+
+$nixstore --import < $TEST_ROOT/exp_all3.bz2
+$nixstore --check-validity $outPath
+
+# The same goes for `--dump' and `--restore'.
+$nixstore --dump --bzip2 $outPath > $TEST_ROOT/exp.nar.bz2
+rm -rf $TEST_ROOT/exp_restored
+$nixstore --restore $TEST_ROOT/exp_restored < $TEST_ROOT/exp.nar.bz2
+diff -r $outPath $TEST_ROOT/exp_restored
+
+
+# A large import must not keep a lock (i.e. a file descriptor) per
+# path open until the end.
+rm -rf $TEST_ROOT/many
+mkdir $TEST_ROOT/many
+for i in $(seq 1 1100); do echo $i > $TEST_ROOT/many/$i; done
+manyPaths=$($nixstore --add $TEST_ROOT/many/*)
+$nixstore --export $manyPaths > $TEST_ROOT/exp_many
+
+clearStore
+
+(ulimit -n 1024; $nixstore --import < $TEST_ROOT/exp_many > /dev/null)
+$nixstore --check-validity $manyPaths
@@ -12,6 +12,9 @@ $nixstore --gc --print-live | grep $outPath
 $nixstore --gc --print-dead | grep $drvPath
 if $nixstore --gc --print-dead | grep $outPath; then false; fi
 
+# The root retains at least its own output.
+test "$($nixstore --gc --print-impact | grep "$outPath" | cut -d ' ' -f 1)" -ge "$($nixstore -q --size $outPath)"
+
 $nixstore --gc --print-dead
 
 inUse=$(readLink $outPath/input-2)
@@ -36,3 +39,49 @@ $NIX_BIN_DIR/nix-collect-garbage
 
 # Check that the output has been GC'd.
 if test -e $outPath/foobar; then false; fi
+
+
+# Incremental collection: with a slice after every deleted path, all
+# dead paths are still deleted, and live ones kept.
+rm -rf $TEST_ROOT/gc-files
+mkdir $TEST_ROOT/gc-files
+for i in $(seq 1 10); do echo dead-$i > $TEST_ROOT/gc-files/dead-$i; done
+echo live > $TEST_ROOT/gc-files/live
+deadPaths=$($nixstore --add $TEST_ROOT/gc-files/dead-*)
+livePath=$($nixstore --add $TEST_ROOT/gc-files/live)
+ln -sf $livePath "$NIX_STATE_DIR"/gcroots/live
+
+$nixstore --gc --slice-bytes 1 --slice-time 1
+
+for i in $deadPaths; do if test -e $i; then false; fi; done
+test -e $livePath
+rm "$NIX_STATE_DIR"/gcroots/live
+
+
+# The least recently used dead paths are deleted first.
+$nixstore --gc
+for i in a b c; do echo $i > $TEST_ROOT/gc-files/$i; done
+pathA=$($nixstore --add $TEST_ROOT/gc-files/a)
+pathB=$($nixstore --add $TEST_ROOT/gc-files/b)
+pathC=$($nixstore --add $TEST_ROOT/gc-files/c)
+setLastUsed() {
+    echo "update ValidPaths set lastUsed = $2 where path = '$1';" | $sqlite3 $NIX_DB_DIR/db.sqlite
+}
+setLastUsed $pathA 100
+setLastUsed $pathB 300
+setLastUsed $pathC 200
+
+$nixstore --gc --max-freed 1
+if test -e $pathA; then false; fi
+test -e $pathB
+test -e $pathC
+
+# Shrinking the store by a single byte requires deleting one more path.
+storeSize=$(echo "select sum(narSize) from ValidPaths;" | $sqlite3 $NIX_DB_DIR/db.sqlite)
+$nixstore --gc --max-store-size $((storeSize - 1))
+if test -e $pathC; then false; fi
+test -e $pathB
+
+# There is at least a byte of free space, so nothing is deleted.
+$nixstore --gc --min-free 1
+test -e $pathB
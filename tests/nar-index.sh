@@ -0,0 +1,30 @@
+source common.sh
+
+rm -rf $TEST_ROOT/nar-index
+mkdir -p $TEST_ROOT/nar-index/dir/sub
+echo foo > $TEST_ROOT/nar-index/dir/sub/a
+echo "#! /bin/sh" > $TEST_ROOT/nar-index/dir/b
+chmod +x $TEST_ROOT/nar-index/dir/b
+ln -s sub/a $TEST_ROOT/nar-index/dir/c
+
+$nixstore --dump $TEST_ROOT/nar-index/dir --index $TEST_ROOT/nar-index/idx > $TEST_ROOT/nar-index/nar
+
+# Indexing an existing archive gives the same result.
+$nixstore --index-nar < $TEST_ROOT/nar-index/nar > $TEST_ROOT/nar-index/idx2
+cmp $TEST_ROOT/nar-index/idx $TEST_ROOT/nar-index/idx2
+
+grep -q "^executable .* /b$" $TEST_ROOT/nar-index/idx
+
+catNar() {
+    $nixstore --cat-nar $TEST_ROOT/nar-index/nar $TEST_ROOT/nar-index/idx "$@"
+}
+
+test "$(catNar /sub/a)" = foo
+test "$(catNar /b)" = "#! /bin/sh"
+test "$(catNar /c)" = sub/a
+test "$(catNar /sub/a --offset 1 --length 1)" = o
+
+if catNar /sub; then
+    echo "extracting a directory should fail"
+    exit 1
+fi
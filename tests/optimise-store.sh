@@ -0,0 +1,107 @@
+source common.sh
+
+clearStore
+
+mkdir -p $TEST_ROOT/opt1 $TEST_ROOT/opt2
+echo foo > $TEST_ROOT/opt1/a
+echo foo > $TEST_ROOT/opt2/a
+
+path1=$($nixstore --add $TEST_ROOT/opt1)
+path2=$($nixstore --add $TEST_ROOT/opt2)
+
+$nixstore --optimise
+
+inode1="$(stat -c %i $path1/a)"
+inode2="$(stat -c %i $path2/a)"
+if [ "$inode1" != "$inode2" ]; then
+    echo "files do not have the same inode"
+    exit 1
+fi
+
+# A second run shouldn't look at the paths again.
+$nixstore --optimise 2>&1 | grep "skipped 2 paths"
+
+# The link in the index is removed once no path uses it anymore.
+$nixstore --delete $path1 $path2
+if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
+    echo ".links directory not empty after deleting"
+    exit 1
+fi
+
+# With `auto-optimise-store', paths are optimised when they're added.
+echo "auto-optimise-store = true" >> $NIX_CONF_DIR/nix.conf
+path1=$($nixstore --add $TEST_ROOT/opt1)
+path2=$($nixstore --add $TEST_ROOT/opt2)
+sed -i '/auto-optimise-store/d' $NIX_CONF_DIR/nix.conf
+
+inode1="$(stat -c %i $path1/a)"
+inode2="$(stat -c %i $path2/a)"
+test "$inode1" = "$inode2"
+
+
+# Files are only hashed when there is another file that could have
+# the same contents.  A file with a unique type and size gets an
+# index entry named after those.
+clearStore
+rm -rf $TEST_ROOT/opt3 $TEST_ROOT/opt4 $TEST_ROOT/opt5 $TEST_ROOT/opt6
+mkdir -p $TEST_ROOT/opt3 $TEST_ROOT/opt4 $TEST_ROOT/opt5 $TEST_ROOT/opt6
+echo "unique contents" > $TEST_ROOT/opt3/u
+echo bar1 > $TEST_ROOT/opt3/b
+echo bar2 > $TEST_ROOT/opt4/b
+path3=$($nixstore --add $TEST_ROOT/opt3)
+path4=$($nixstore --add $TEST_ROOT/opt4)
+
+$nixstore --optimise
+
+test -e $NIX_STORE_DIR/.links/r-16
+
+# Files of the same size but with different contents are hashed, but
+# not linked.
+test "$(stat -c %i $path3/b)" != "$(stat -c %i $path4/b)"
+test "$(ls $NIX_STORE_DIR/.links | grep -c '^[0-9a-z]\{52\}$')" = 2
+
+# A later path with the same contents as an unhashed entry gets the
+# entry hashed and renamed, and is linked to it.  This also uses
+# several hashing processes.
+echo "optimise-jobs = 3" >> $NIX_CONF_DIR/nix.conf
+cp $TEST_ROOT/opt3/u $TEST_ROOT/opt5/u
+path5=$($nixstore --add $TEST_ROOT/opt5)
+$nixstore --optimise
+test "$(stat -c %i $path3/u)" = "$(stat -c %i $path5/u)"
+if test -e $NIX_STORE_DIR/.links/r-16; then false; fi
+test "$(ls $NIX_STORE_DIR/.links | grep -c '^[0-9a-z]\{52\}$')" = 3
+
+# The same with `auto-optimise-store', which hashes the files of new
+# paths right away.
+echo "more unique contents" > $TEST_ROOT/opt6/v
+path6=$($nixstore --add $TEST_ROOT/opt6)
+$nixstore --optimise
+test -e $NIX_STORE_DIR/.links/r-21
+echo "auto-optimise-store = true" >> $NIX_CONF_DIR/nix.conf
+rm -rf $TEST_ROOT/opt6; mkdir $TEST_ROOT/opt6
+echo "more unique contents" > $TEST_ROOT/opt6/v
+echo x > $TEST_ROOT/opt6/w
+path7=$($nixstore --add $TEST_ROOT/opt6)
+test "$(stat -c %i $path6/v)" = "$(stat -c %i $path7/v)"
+if test -e $NIX_STORE_DIR/.links/r-21; then false; fi
+sed -i '/auto-optimise-store/d' $NIX_CONF_DIR/nix.conf
+
+# Files larger than 64 KiB are first compared by the hash of their
+# first 64 KiB.  Files that differ only after that aren't linked, nor
+# are files that differ in the first 64 KiB, which needn't be hashed
+# completely.
+clearStore
+rm -rf $TEST_ROOT/opt7 $TEST_ROOT/opt8 $TEST_ROOT/opt9
+mkdir -p $TEST_ROOT/opt7 $TEST_ROOT/opt8 $TEST_ROOT/opt9
+head -c 70000 /dev/zero > $TEST_ROOT/opt7/big
+(head -c 69999 /dev/zero; echo -n x) > $TEST_ROOT/opt8/big
+(echo -n x; head -c 69999 /dev/zero) > $TEST_ROOT/opt9/big
+path7=$($nixstore --add $TEST_ROOT/opt7)
+path8=$($nixstore --add $TEST_ROOT/opt8)
+path9=$($nixstore --add $TEST_ROOT/opt9)
+$nixstore --optimise
+test "$(stat -c %i $path7/big)" != "$(stat -c %i $path8/big)"
+test "$(stat -c %i $path7/big)" != "$(stat -c %i $path9/big)"
+test "$(ls $NIX_STORE_DIR/.links | grep -c '^r-70000-[0-9a-z]\{52\}$')" = 1
+test "$(ls $NIX_STORE_DIR/.links | grep -c '^[0-9a-z]\{52\}$')" = 2
+sed -i '/optimise-jobs/d' $NIX_CONF_DIR/nix.conf
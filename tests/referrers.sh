@@ -25,7 +25,7 @@ echo "registering..."
 
 time $nixstore --register-validity < $TEST_ROOT/reg_info
 
-oldTime=$(cat test-tmp/db/info/1 | grep Registered-At)
+oldTime=$(echo "select registrationTime from ValidPaths where path = '$NIX_STORE_DIR/1'" | $sqlite3 ./test-tmp/db/db.sqlite)
 
 echo "sleeping..."
 
@@ -35,14 +35,14 @@ echo "reregistering..."
 
 time $nixstore --register-validity --reregister < $TEST_ROOT/reg_info
 
-newTime=$(cat test-tmp/db/info/1 | grep Registered-At)
+newTime=$(echo "select registrationTime from ValidPaths where path = '$NIX_STORE_DIR/1'" | $sqlite3 ./test-tmp/db/db.sqlite)
 
 if test "$newTime" != "$oldTime"; then
     echo "reregistration changed original registration time"
     exit 1
 fi
 
-if test "$(cat test-tmp/db/referrer/1 | wc -w)" -ne 1; then
+if test "$(echo "select count(*) from Refs" | $sqlite3 ./test-tmp/db/db.sqlite)" -ne $((2 * max - 1)); then
     echo "reregistration duplicated referrers"
     exit 1
 fi
@@ -51,7 +51,7 @@ echo "collecting garbage..."
 ln -sfn $reference "$NIX_STATE_DIR"/gcroots/ref
 time $nixstore --gc
 
-if test "$(cat test-tmp/db/referrer/abcdef | wc -w)" -ne 0; then
+if test "$(echo "select count(*) from Refs" | $sqlite3 ./test-tmp/db/db.sqlite)" -ne 0; then
     echo "referrers not cleaned up"
     exit 1
 fi
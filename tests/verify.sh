@@ -1,3 +1,9 @@
 source common.sh
 
 $nixstore --verify
+
+$nixstore --verify --check-contents -j 2
+
+# All paths have now been verified, so an incremental run shouldn't
+# check anything.
+$nixstore --verify --check-contents --incremental 2>&1 | grep "checked 0 paths"